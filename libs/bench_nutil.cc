@@ -0,0 +1,296 @@
+/*
+ * libnutil microbenchmarks
+ *
+ * Times the hot path primitives of the library and prints one JSON object
+ * per line, for runs to be diffed before a change goes to the boards:
+ *
+ *   {"bench":"<name>","unit":"ns","samples":N,"batch":B,
+ *    "min":..,"mean":..,"p50":..,"p99":..,"max":..}
+ *
+ * the time of one call, out of N samples of B calls each (percentiles
+ * within the ~3% of util::histogram), or for the testers
+ *
+ *   {"bench":"<name>","unit":"payloads/s","value":..,"errors":..}
+ *
+ * Names and keys only ever get added to. Whatever else the library
+ * prints goes to stderr.
+ *
+ *   clock.now, clock.duration_in_seconds, log.timestamp
+ *   serial.open, serial.set_speed, serial.flush, serial.reset
+ *                     on the slave of a pty pair
+ *   thread.create     pthread_create() and join, default stack
+ *   thread.create.prefault
+ *                     the same, the thread prefaulting rttest's 100KB
+ *   thread.create.rt_stack
+ *                     with an rt_thread_stack() stack, allocation included
+ *   rt_init.all, rt_init.budget
+ *                     rt_init() of a fresh forked process, needs the
+ *                     rights to mlockall(), as the tools do
+ *   tester.loopback.<bits>
+ *                     UartTester Send/Receive threads over the in-memory
+ *                     loopback backend, count verify, batched
+ *
+ * usage: bench_nutil [seconds per tester run, default 0.5]
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "cacheline.hh"
+#include "clock.hh"
+#include "log.hh"
+#include "realtime.hh"
+#include "serial.hh"
+#include "stats.hh"
+
+#include "uart_tester.hh"
+
+using namespace nomovok;
+using namespace std;
+
+static const int thread_stack_size = 100 * 1024;
+/* past any real fd, every tester run gets a fresh ring */
+static int loopback_key = 1 << 20;
+
+static volatile double sink;
+
+static uint64_t now_ns()
+{
+	return util::monotonic_clock::now().time_since_epoch().count();
+}
+
+/* h holds the time of whole batches */
+static void emit(const char *bench, const util::histogram &h, int batch)
+{
+	printf("{\"bench\":\"%s\",\"unit\":\"ns\",\"samples\":%" PRIu64
+		",\"batch\":%d,\"min\":%.1f,\"mean\":%.1f,\"p50\":%.1f"
+		",\"p99\":%.1f,\"max\":%.1f}\n", bench, h.count(), batch,
+		(double)h.min() / batch, h.mean() / batch,
+		(double)h.percentile(50) / batch,
+		(double)h.percentile(99) / batch, (double)h.max() / batch);
+	fflush(stdout);
+}
+
+/* a batch to warm up, then samples timed batches of f() */
+template <typename F>
+static void time_calls(const char *bench, int samples, int batch, F f)
+{
+	util::histogram h;
+
+	for (int i = 0; i < batch; ++i)
+		f();
+
+	for (int s = 0; s < samples; ++s) {
+		const uint64_t start = now_ns();
+
+		for (int i = 0; i < batch; ++i)
+			f();
+		h.add(now_ns() - start);
+	}
+
+	emit(bench, h, batch);
+}
+
+static void bench_clock()
+{
+	const auto start = util::monotonic_clock::now();
+
+	time_calls("clock.now", 1000, 1000, [] {
+		sink = util::monotonic_clock::now().time_since_epoch().count();
+	});
+	time_calls("clock.duration_in_seconds", 1000, 1000, [&] {
+		sink = util::duration_in_seconds(
+			util::monotonic_clock::now() - start);
+	});
+	time_calls("log.timestamp", 1000, 100, [] {
+		sink = util::timestamp().size();
+	});
+}
+
+static void bench_serial()
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+	if (master == -1 || grantpt(master) || unlockpt(master)) {
+		perror("bench_nutil: no pty");
+		return;
+	}
+
+	const string slave = ptsname(master);
+	speed_t speed = B115200;
+
+	time_calls("serial.open", 200, 1, [&] {
+		util::serial sp(slave);
+	});
+
+	util::serial sp(slave);
+
+	time_calls("serial.set_speed", 1000, 1, [&] {
+		speed = speed == B115200 ? B9600 : B115200;
+		sp.set_speed(speed);
+	});
+	time_calls("serial.flush", 1000, 1, [&] {
+		sp.flush();
+	});
+	time_calls("serial.reset", 200, 1, [&] {
+		sp.reset();
+	});
+
+	close(master);
+}
+
+static void *idle_thread(void *)
+{
+	return 0;
+}
+
+static void *prefault_thread(void *)
+{
+	util::rt_stack_prefault(thread_stack_size);
+	return 0;
+}
+
+static void start_and_join(pthread_attr_t *attr, void *(*run)(void *))
+{
+	pthread_t tid;
+
+	if (pthread_create(&tid, attr, run, 0)) {
+		perror("bench_nutil: pthread_create failed");
+		exit(1);
+	}
+	pthread_join(tid, 0);
+}
+
+static void bench_threads()
+{
+	const size_t stack_size = PTHREAD_STACK_MIN + thread_stack_size;
+
+	time_calls("thread.create", 500, 1, [] {
+		start_and_join(0, idle_thread);
+	});
+	time_calls("thread.create.prefault", 500, 1, [] {
+		start_and_join(0, prefault_thread);
+	});
+	time_calls("thread.create.rt_stack", 500, 1, [&] {
+		pthread_attr_t attr;
+
+		pthread_attr_init(&attr);
+		void *stack = util::rt_thread_stack(&attr, stack_size);
+
+		start_and_join(&attr, prefault_thread);
+		pthread_attr_destroy(&attr);
+		util::rt_free(stack, stack_size);
+	});
+}
+
+/* rt_init() once per process, so every sample is a child of its own */
+static void bench_rt_init(const char *bench, util::rt_memory mode)
+{
+	util::histogram h;
+
+	for (int s = 0; s < 10; ++s) {
+		uint64_t ns;
+		int fds[2];
+
+		if (pipe(fds) == -1) {
+			perror("bench_nutil: pipe failed");
+			return;
+		}
+
+		fflush(stdout);
+		pid_t pid = fork();
+
+		if (pid == 0) {
+			/* rt_init() reports on stdout */
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+
+			const uint64_t start = now_ns();
+
+			util::rt_init(mode);
+			ns = now_ns() - start;
+			if (write(fds[1], &ns, sizeof(ns)) != sizeof(ns))
+				_exit(1);
+			_exit(0);
+		}
+
+		close(fds[1]);
+		const bool ok = pid > 0 &&
+			read(fds[0], &ns, sizeof(ns)) == sizeof(ns);
+		close(fds[0]);
+		if (pid > 0)
+			waitpid(pid, 0, 0);
+
+		if (!ok) {
+			fprintf(stderr, "bench_nutil: %s failed\n", bench);
+			return;
+		}
+		h.add(ns);
+	}
+
+	emit(bench, h, 1);
+}
+
+static void bench_tester(int payload_bits, double seconds)
+{
+	const int key = loopback_key++;
+	auto tester_tx = peloton::MakeTester(key, payload_bits, "count",
+		"batched", "loopback");
+	auto tester_rx = peloton::MakeTester(key, payload_bits, "count",
+		"batched", "loopback");
+	util::stop_token stop;
+	const string bench = "tester.loopback." + to_string(payload_bits);
+
+	const auto start = util::monotonic_clock::now();
+
+	thread tx(&peloton::Tester::SendUntilCancelled, tester_tx.get(),
+		cref(stop), UINT64_MAX);
+	thread rx(&peloton::Tester::ReceiveUntilCancelled, tester_rx.get(),
+		cref(stop), UINT64_MAX);
+
+	this_thread::sleep_for(chrono::microseconds((uint64_t)(seconds * 1e6)));
+	stop.request_stop();
+	tx.join();
+	rx.join();
+
+	const double elapsed =
+		util::duration_in_seconds(util::monotonic_clock::now() - start);
+
+	printf("{\"bench\":\"%s\",\"unit\":\"payloads/s\",\"value\":%.0f"
+		",\"errors\":%" PRIu64 "}\n", bench.c_str(),
+		tester_rx->num_successes() / elapsed, tester_rx->num_errors());
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	static const int widths[] = { 8, 16, 32, 64 };
+	double seconds = 0.5;
+
+	if (argc > 1)
+		seconds = atof(argv[1]);
+
+	bench_clock();
+	bench_serial();
+	bench_threads();
+	bench_rt_init("rt_init.all", util::RT_MEMORY_ALL);
+	bench_rt_init("rt_init.budget", util::RT_MEMORY_BUDGET);
+
+	for (int w : widths)
+		bench_tester(w, seconds);
+
+	return 0;
+}
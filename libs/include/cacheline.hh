@@ -0,0 +1,40 @@
+#ifndef __cacheline_hh
+#define __cacheline_hh
+
+#include <atomic>
+#include <cstddef>
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Line size of the cores we run on (Cortex-A and x86 alike). Data
+ * written by different threads goes on different lines, or every write
+ * bounces the line between the cores.
+ */
+static const size_t cache_line_size = 64;
+
+/*
+ * Stop request for the worker threads of a tool.
+ *
+ * The flag is polled from the hot loops, so it sits alone on its cache
+ * line and is only read until somebody asks to stop. Lock-free, so it
+ * can be set from a signal handler.
+ */
+class alignas(cache_line_size) stop_token
+{
+public:
+	stop_token() : flag(false) {}
+
+	void request_stop() { flag.store(true, std::memory_order_relaxed); }
+	bool stop_requested() const
+	{ return flag.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic_bool flag;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __cacheline_hh
@@ -0,0 +1,79 @@
+#ifndef __irq_hh
+#define __irq_hh
+
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/types.h>
+
+using std::string;
+
+namespace nomovok {
+namespace util {
+
+/*
+ * IRQ placement for a tty
+ *
+ * Finds the interrupt lines serving a tty, from sysfs and /proc/interrupts,
+ * and, on threaded irq kernels (PREEMPT_RT, or threadirqs), the irq/NN-name
+ * kernel threads running their handlers. Those can then be given a
+ * SCHED_FIFO priority and a cpu, relative to the tester threads: a RX
+ * thread spinning above its irq thread on the same cpu starves the handler
+ * feeding it.
+ *
+ * Everything changed is put back by restore(), or by the destructor.
+ */
+struct irq_thread {
+	pid_t pid;
+	string comm;
+	int policy;
+	int prio;
+	cpu_set_t cpus;
+};
+
+struct irq_line {
+	int irq;
+	string cpus;			/* smp_affinity_list, as read */
+	std::vector<irq_thread> threads;
+};
+
+class irq_tuning
+{
+public:
+	irq_tuning() : prio_changed(false), affinity_changed(false) {}
+	~irq_tuning() { restore(); }
+
+	/*
+	 * device as /dev/ttyS0, a symlink to it, or just ttyS0.
+	 * Returns false if no irq serves it (ptys, network ports ...).
+	 */
+	bool find(const string &device);
+
+	/* SCHED_FIFO prio for all the irq threads found */
+	bool set_priority(int prio);
+	/* moves the irqs, and so their threads, to the given cpu */
+	bool set_affinity(int cpu);
+
+	void restore();
+
+	/* one line per irq and per irq thread, current settings */
+	void print() const;
+
+	const std::vector<irq_line> &lines() const { return found; }
+	size_t num_threads() const;
+
+private:
+	string tty;
+	std::vector<irq_line> found;	/* as found, to be restored */
+	bool prio_changed;
+	bool affinity_changed;
+};
+
+/* cpu_set_t as a "0-3,6" list */
+string cpu_list(const cpu_set_t &set);
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __irq_hh
@@ -0,0 +1,82 @@
+#ifndef __load_hh
+#define __load_hh
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <sched.h>
+#include <sys/types.h>
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Background load, to see the serial RT behaviour under contention
+ *
+ * A profile is load specs joined by '+', each
+ *
+ *   kind[:workers][@cpus][%duty][/size]
+ *
+ *   cpu    busy loop
+ *   mem    memcpy through a buffer (size, default 16M), memory bandwidth
+ *   fault  touches every page of a region (size, default 16M), drops it
+ *          and starts over, a page fault storm
+ *   fork   fork and exec of /bin/true, process churn
+ *   ipc    64K writes through a pipe, to a reader draining it
+ *   net    the same through a loopback TCP connection
+ *
+ * e.g. "cpu:2@1-2+mem/64M%50+fork". Workers run duty percent of every
+ * 10 ms, default 100, on cpus, default the ones set_cpus() gave, i.e. all
+ * but the RT ones. Time ipc and net wait on a full pipe or socket is idle
+ * time, not busy.
+ *
+ * Every worker is a process of its own, SCHED_OTHER and with no memory
+ * locked, so neither the RT policy nor the mlockall() of the tool carry
+ * over to it. Workers die with the tool.
+ */
+struct load_spec {
+	std::string kind;
+	int workers;
+	int duty;			/* percent */
+	size_t size;
+	bool pinned;
+	cpu_set_t cpus;
+};
+
+class load_generator
+{
+public:
+	load_generator();
+	~load_generator();
+
+	bool parse(const std::string &profile);
+	/* where workers without @cpus run */
+	void set_cpus(const cpu_set_t &cpus);
+
+	bool start();
+	void stop();
+
+	bool empty() const { return specs.empty(); }
+	/* the profile as run, all defaults spelled out, for the results */
+	std::string profile() const;
+	/* what each kind got done */
+	void print() const;
+
+private:
+	void worker(const load_spec &spec, std::atomic<uint64_t> *ops);
+
+	std::vector<load_spec> specs;
+	cpu_set_t default_cpus;
+	std::vector<pid_t> pids;
+	std::atomic<uint64_t> *counters;	/* shared with the workers */
+	size_t num_counters;
+	uint64_t start_ns;
+	uint64_t stop_ns;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __load_hh
@@ -1,15 +1,54 @@
 #ifndef __realtime_hh
 #define __realtime_hh
 
+#include <cstddef>
+
+#include <pthread.h>
+
 namespace nomovok {
 namespace util {
 
-void rt_init();
-void rt_stack_prefault();
+/*
+ * How rt_init() keeps the tool in RAM.
+ *
+ * RT_MEMORY_ALL locks everything, now and later: every thread stack at
+ * its full (8 MB default) size, every library buffer. RT_MEMORY_BUDGET
+ * locks what is mapped at init (code, data, the heap so far), then only
+ * what is asked for: rt_alloc() buffers, rt_thread_stack() stacks,
+ * rt_lock()ed regions and rt_stack_prefault()ed stack tops, the latter
+ * unlocked again when their thread exits. The serial backends take
+ * their fixed buffers from rt_alloc(). Left out: the tcp backend's
+ * buffers, heap vectors that grow with the traffic, and the io_uring
+ * rings, kernel pages that can't be swapped out anyway.
+ */
+enum rt_memory {
+	RT_MEMORY_ALL,
+	RT_MEMORY_BUDGET,
+};
+
+void rt_init(rt_memory mode = RT_MEMORY_ALL);
+/* touches size bytes of the stack, locked too in budget mode */
+void rt_stack_prefault(size_t size = 8 * 1024);
 void rt_set_thread_prio_or_die(int value);
 void rt_set_thread_prio_or_die(pthread_t thread, int value);
+bool rt_set_processor_affinity(int core_id);
+
+/*
+ * Locked and faulted in buffer, page aligned, on hugepages from the
+ * hugepage size up when the system has some (hugetlbfs, then THP).
+ */
+void *rt_alloc(size_t size);
+void rt_free(void *p, size_t size);
+/* locks and faults in a region that is already there, whole pages */
+bool rt_lock(const void *p, size_t size);
+void rt_unlock(const void *p, size_t size);
+/* a locked stack of size for a thread, rt_free() it after the join */
+void *rt_thread_stack(pthread_attr_t *attr, size_t size);
+
+/* VmLck against what has been asked for, VmRSS, hugepages and faults */
+void rt_memory_report(const char *when);
 
 } /* end of ns util */
 } /* end of ns nomovok */
 
-#endif // __realtime_hh
\ No newline at end of file
+#endif // __realtime_hh
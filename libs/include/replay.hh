@@ -0,0 +1,58 @@
+#ifndef __replay_hh
+#define __replay_hh
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cacheline.hh"
+#include "stats.hh"
+#include "trace.hh"
+
+using std::string;
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Replays a captured byte stream onto a fd with its original timing.
+ *
+ * The stream comes either from a flight recorder trace (the byte records
+ * of one direction, block records only carry their first bytes and are
+ * skipped) or from a raw capture, paced at the wire rate of the given
+ * baud rate.
+ */
+class replay
+{
+public:
+	replay() : skipped_records(0) {}
+
+	bool load_trace(const string &path, trace_dir dir);
+	bool load_raw(const string &path, int baud_rate);
+
+	size_t size() const { return data.size(); }
+	const std::vector<uint8_t> &bytes() const { return data; }
+	/* records that could not be replayed */
+	uint64_t skipped() const { return skipped_records; }
+	double duration() const;
+
+	/*
+	 * speed scales the original timing, 1 is real time, 2 twice as
+	 * fast, 0 as fast as possible. Each paced write adds how late it
+	 * was on its scaled send time to lateness, if given.
+	 * Stops early if a stop is requested.
+	 */
+	void run(int fd, double speed, const stop_token *stop = 0,
+		 histogram *lateness = 0) const;
+
+private:
+	std::vector<uint8_t> data;
+	std::vector<uint64_t> offset_ns;	/* per byte, from the first */
+	uint64_t skipped_records;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __replay_hh
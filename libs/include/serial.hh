@@ -2,8 +2,11 @@
 #define __serial_hh
 
 #include <termios.h>
+#include <cstddef>
 #include <string>
 
+#include "clock.hh"
+
 using std::string;
 
 namespace nomovok {
@@ -26,6 +29,9 @@ public:
 	void reset();
 	void open(const string &device);
 
+	monotonic_clock::time_point write_paced(const void *buf, size_t len,
+		const monotonic_clock::time_point &when);
+
 private:
 	int fds;
 	struct termios oldterm;
@@ -33,6 +39,14 @@ private:
 	speed_t _speed;
 };
 
+/*
+ * Paced write: waits until when, then writes the whole buffer to the
+ * (non-blocking) fd. Returns the time the first byte has been accepted,
+ * so the caller can measure how late it was.
+ */
+monotonic_clock::time_point write_paced(int fd, const void *buf, size_t len,
+	const monotonic_clock::time_point &when);
+
 } /* end of ns util */
 } /* end of ns nomovok */
 
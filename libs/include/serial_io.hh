@@ -0,0 +1,390 @@
+#ifndef __serial_io_hh
+#define __serial_io_hh
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "stats.hh"
+
+using std::string;
+
+/* from linux/io_uring.h */
+struct io_uring_sqe;
+struct io_uring_cqe;
+/* from linux/can.h */
+struct can_frame;
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Batched I/O backends for a serial fd
+ *
+ * All of them share the same non-blocking, batched interface: read()
+ * and write() move up to len bytes and return how many, 0 if nothing
+ * could be moved right now, -1 on errors (errno set).
+ *
+ * A backend instance belongs to the one thread calling it, a TX and a RX
+ * thread on the same port each get their own.
+ */
+class serial_backend
+{
+public:
+	virtual ~serial_backend() {}
+
+	virtual ssize_t read(void *buf, size_t len) = 0;
+	virtual ssize_t write(const void *buf, size_t len) = 0;
+
+	virtual const char *name() const = 0;
+
+	/* backend specific counters, if any, to stdout */
+	virtual void print_stats() const {}
+};
+
+/* read(2)/write(2) straight on the fd */
+class plain_backend : public serial_backend
+{
+public:
+	plain_backend(int fd) : fds(fd) {}
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const { return "plain"; }
+
+private:
+	int fds;
+};
+
+/*
+ * In-memory loopback, no port behind it
+ *
+ * What is written on fd comes back from the reads on fd, through a 64KB
+ * ring per fd number, shared by all the loopback backends made for it:
+ * the TX and RX backends of a port looped back to itself. fd is only the
+ * ring's key, it is never touched. No syscalls, so what a benchmark sees
+ * is the cost of the callers. One writer and one reader per ring, rings
+ * live as long as the process.
+ */
+class loopback_backend : public serial_backend
+{
+public:
+	loopback_backend(int fd);
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const { return "loopback"; }
+
+private:
+	struct ring;
+
+	ring *r;
+};
+
+/*
+ * Sleeps in epoll_wait() until the fd is ready, up to timeout_ms, then
+ * does a plain read/write. Costs a syscall more, but no cpu while idle.
+ */
+class epoll_backend : public serial_backend
+{
+public:
+	epoll_backend(int fd, int timeout_ms = 10);
+	~epoll_backend();
+
+	/* false if an epoll instance couldn't be set up */
+	bool ok() const { return epfd_in != -1 && epfd_out != -1; }
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const { return "epoll"; }
+
+private:
+	bool wait(int epfd);
+
+	int fds;
+	int epfd_in;
+	int epfd_out;
+	int timeout;
+};
+
+/*
+ * Spin, then sleep
+ *
+ * When nothing is there, read() keeps retrying for a spin window, with a
+ * cpu pause between the attempts. It then sleeps in poll(2) up to
+ * timeout_ms. Data coming in within the window is caught with no
+ * wakeup latency at all, slower traffic costs no cpu.
+ *
+ * The window is either fixed (spin_ns, 0 to always poll), or self-tuning
+ * (tune_window): twice the moving average of the observed waits, reads
+ * that found data right away counting as 0, as long as that stays below
+ * max_spin_ns. Longer waits are left to poll() straight away. Writes
+ * always wait in poll(), a full tx buffer drains at the baud rate.
+ */
+class adaptive_backend : public serial_backend
+{
+public:
+	static const uint64_t max_spin_ns = 100000;
+	static const uint64_t tune_window = ~0ULL;
+
+	adaptive_backend(int fd, uint64_t spin_ns = tune_window,
+			 int timeout_ms = 10);
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const { return "adaptive"; }
+
+	/* reads that found data right away, while spinning, after poll() */
+	uint64_t immediate() const { return num_immediate; }
+	uint64_t spin_hits() const { return num_spin; }
+	uint64_t poll_hits() const { return num_poll; }
+	uint64_t window_ns() const { return window; }
+	/* cpu used by the calling thread over the time it has been used */
+	double cpu_load() const;
+
+	/*
+	 * Spin hit fraction, window and cpu load. Thread cpu time is
+	 * sampled by the reads every millisecond, whichever way they
+	 * found their data, so it lags by that much at most.
+	 */
+	void print_stats() const;
+
+private:
+	void observe(uint64_t wait_ns);
+	void sample_cpu(uint64_t now);
+
+	int fds;
+	bool tuning;
+	uint64_t window;
+	uint64_t avg_wait;		/* ns, moving average */
+	int timeout;
+
+	uint64_t num_immediate;
+	uint64_t num_spin;
+	uint64_t num_poll;
+	uint64_t wall_start;		/* ns, first read */
+	uint64_t wall_last;
+	uint64_t cpu_start;		/* ns, thread cpu time */
+	uint64_t cpu_last;
+};
+
+/*
+ * io_uring backend
+ *
+ * Keeps a linked poll + READ_FIXED pair in flight on the fd at all times,
+ * writes go out as linked poll + WRITE_FIXED, both from buffers registered
+ * with the ring, so a read or write is mostly a memcpy and no syscall.
+ * The poll link is what makes it work on O_NONBLOCK ttys, io_uring would
+ * just return -EAGAIN otherwise. Optionally with a SQPOLL kernel thread
+ * doing the submission, no syscalls at all while it is awake. That
+ * thread needs a core of its own, next to a thread spinning on the
+ * backend on the same cpu it starves.
+ *
+ * Talks to the kernel directly, no liburing. Check ok() after
+ * construction, kernels before 5.1 (or with io_uring disabled) fail.
+ */
+class uring_backend : public serial_backend
+{
+public:
+	uring_backend(int fd, bool sqpoll = false, size_t buf_size = 4096);
+	~uring_backend();
+
+	bool ok() const { return ring_fd != -1; }
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const
+	{ return sqpoll ? "io_uring-sqpoll" : "io_uring"; }
+
+private:
+	bool setup();
+	void teardown();
+	bool submit(unsigned count);
+	void reap();
+	void arm_read();
+	void arm_write();
+
+	int fds;
+	bool sqpoll;
+	size_t buf_size;
+	int ring_fd;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_flags;
+	unsigned *sq_array;
+	io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+
+	uint8_t *bufs;			/* rx buffer, then tx buffer */
+	bool rx_pending;
+	size_t rx_have;			/* completed, not handed out yet */
+	size_t rx_off;
+	bool tx_pending;
+	size_t tx_have;			/* accepted, not written yet */
+	size_t tx_off;
+	int error;			/* errno of a failed completion */
+};
+
+/*
+ * SocketCAN backend
+ *
+ * Carries the byte stream in classic CAN frames of up to 8 bytes, all
+ * sent with tx_id, a batch of frames per sendmmsg()/recvmmsg(). With 64
+ * bit payloads every frame carries one counter. The fd is a raw CAN
+ * socket from can_open(), its filter picks the peer's frames.
+ *
+ * The kernel stamps the frames on reception (SO_TIMESTAMPNS), the delay
+ * from there to read() is kept in a histogram.
+ */
+class can_backend : public serial_backend
+{
+public:
+	enum { batch = 64 };
+
+	can_backend(int fd, uint32_t tx_id);
+	~can_backend();
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const { return "can"; }
+
+	uint64_t frames_out() const { return num_tx; }
+	uint64_t frames_in() const { return num_rx; }
+	/* sendmmsg() calls turned back by a full tx queue */
+	uint64_t tx_full() const { return num_tx_full; }
+	const histogram &rx_delay() const { return delay; }
+
+	void print_stats() const;
+
+private:
+	bool receive();
+
+	int fds;
+	uint32_t id;
+
+	struct can_frame *rx_frames;
+	uint8_t *rx_ctrl;		/* a cmsg buffer per frame */
+	unsigned rx_count;
+	unsigned rx_idx;
+	unsigned rx_off;
+
+	uint64_t num_tx;
+	uint64_t num_rx;
+	uint64_t num_tx_full;
+	histogram delay;
+};
+
+/*
+ * A non-blocking raw CAN socket on interface ifname, receiving only
+ * frames with rx_id (standard or, above 0x7ff, extended), none if
+ * rx_id < 0, with kernel rx timestamps on. -1 on errors.
+ */
+int can_open(const string &ifname, int64_t rx_id);
+
+/*
+ * Serial over TCP, for ports behind a device server
+ *
+ * Raw: the socket carries the port data as is. RFC2217: telnet, 0xff
+ * data bytes are doubled on the way out, commands stripped from what
+ * comes in. The COM port options are negotiated once, on one instance,
+ * before the TX and RX backends are in use: only negotiate() answers the
+ * server, so the RX side never writes into the middle of the TX stream.
+ *
+ * With zerocopy_min set, raw writes of at least that many bytes go out
+ * with MSG_ZEROCOPY: the kernel pins the caller's pages instead of copying
+ * them, so the buffer must stay untouched until zerocopy_pending() drops
+ * back to 0. Only worth it for blocks of 10KB and more.
+ */
+class tcp_backend : public serial_backend
+{
+public:
+	tcp_backend(int fd, bool rfc2217 = false, size_t zerocopy_min = 0);
+
+	ssize_t read(void *buf, size_t len);
+	ssize_t write(const void *buf, size_t len);
+
+	const char *name() const
+	{ return telnet ? "rfc2217" : zc_min ? "tcp-zerocopy" : "tcp"; }
+
+	/*
+	 * Telnet binary mode and COM port control, then the remote port set
+	 * to baud, as serial::set_speed() does locally. Data coming in
+	 * meanwhile is dropped. Returns false if the server didn't confirm
+	 * a baud rate within timeout_ms.
+	 */
+	bool negotiate(uint32_t baud, int timeout_ms = 2000);
+
+	uint64_t zerocopy_pending() const { return zc_sent - zc_done; }
+	/* last SET-BAUDRATE reply of the server, 0 if none */
+	uint32_t remote_baud() const { return baud; }
+
+	void print_stats() const;
+
+private:
+	size_t unescape(uint8_t *p, size_t len);
+	void option(uint8_t verb, uint8_t opt);
+	void subnegotiation();
+	bool send_all(const uint8_t *p, size_t len, int timeout_ms);
+	void reap_zerocopy();
+
+	int fds;
+	bool telnet;
+	size_t zc_min;
+
+	/* telnet parser, commands can be split over reads */
+	int state;
+	std::vector<uint8_t> sb;
+	uint32_t baud;
+	uint64_t num_commands;
+	bool answering;			/* within negotiate() */
+	std::vector<uint8_t> replies;
+	std::vector<bool> answered;	/* per option */
+
+	/* escaped tx data the socket didn't take yet */
+	std::vector<uint8_t> tx;
+	size_t tx_off;
+
+	uint64_t zc_sent;
+	uint64_t zc_done;
+	uint64_t zc_copied;
+};
+
+/*
+ * "host:port" as a non-blocking TCP socket, connected, with Nagle off
+ * so that small blocks leave right away. -1 on errors.
+ */
+int tcp_connect(const string &host_port);
+
+/*
+ * Backend by name: plain, loopback, epoll, adaptive, can, tcp,
+ * tcp-zerocopy, rfc2217, io_uring or io_uring-sqpoll. adaptive=N spins
+ * for a fixed N us instead of tuning its window (0: poll only), can=ID
+ * sends with CAN id ID (default 0x100), tcp-zerocopy uses MSG_ZEROCOPY
+ * from 16KB up. Returns 0, with a message, on unknown names or setup
+ * failures.
+ */
+serial_backend *make_serial_backend(const string &name, int fd);
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __serial_io_hh
@@ -0,0 +1,151 @@
+#ifndef __session_hh
+#define __session_hh
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Two-ended test session over the link under test
+ *
+ * Both ends run the same tool, a short control exchange on the link
+ * itself brackets the test stream:
+ *
+ *   hello    both send their config until each has seen the other's,
+ *            baud, payload width and duration have to match
+ *   barrier  the end with the higher nonce leads: it repeats GO until
+ *            the other answers ACK, which answers every GO until they
+ *            stop, both start a quiet time after the last ACK, within a
+ *            frame time of each other. The leader reads away the ACKs
+ *            still coming meanwhile, none is left for its RX tester
+ *   ...      the test runs for the agreed duration, then each end stops
+ *            sending and keeps receiving for a quiesce time
+ *   probes   optional, around the run: the leader sends numbered probes,
+ *            the follower answers each at once, NTP style, and both get
+ *            the four timestamps of every probe to estimate the offset of
+ *            the other end's clock, and its drift from two clusters
+ *   stats    both send their counters until each has the other's, the
+ *            leader first and after a guard time, so they don't land in
+ *            a receiver that is still running
+ *
+ * Control frames are sync, type, length, payload, crc16, anything else
+ * (a late tail of the test stream) is skipped. Frames are read byte by
+ * byte, never past their end, so the first test bytes after the barrier
+ * are left to the testers. A frame still coming in when a read times out
+ * is kept for the next one, at low baud rates frames take longer on the
+ * wire than a repeat period; repeats are spaced by twice the frame time
+ * then.
+ */
+struct session_config {
+	uint32_t baud;
+	uint32_t payload_bits;
+	uint32_t duration_ms;
+};
+
+/* what one end did, as exchanged at the end */
+struct session_stats {
+	uint64_t tx_packets;
+	uint64_t rx_packets;
+	uint64_t rx_errors;
+	uint64_t rx_missed;
+	uint64_t tx_ns;			/* first to last packet sent */
+	uint64_t rx_ns;
+};
+
+/*
+ * Peer clock against the local one. The offset of a cluster is the one of
+ * its probe with the shortest round trip, it can't be off by more than
+ * half that round trip (bound), jitter is the spread of the better half.
+ */
+struct clock_estimate {
+	int64_t offset_ns;		/* peer - local, at ref_ns */
+	uint64_t ref_ns;		/* local time */
+	uint64_t bound_ns;
+	uint64_t jitter_ns;
+	double drift;			/* offset change per local ns */
+	double drift_bound;
+	int clusters;
+
+	int64_t offset_at(uint64_t local_ns) const
+	{ return offset_ns + drift * (int64_t)(local_ns - ref_ns); }
+};
+
+class session
+{
+public:
+	session(int fd, const session_config &config);
+
+	/* hello and barrier, returns once the test is to start */
+	bool start(int timeout_ms = 10000);
+
+	/* one cluster of clock probes, leaves both ends in step */
+	bool probe_clock(int count = 32, int timeout_ms = 5000);
+
+	/* stats, after the quiesce time */
+	bool exchange(const session_stats &local, int timeout_ms = 5000);
+
+	/* as many values from each end, i.e. timestamps for the other end */
+	bool exchange_values(const std::vector<uint64_t> &mine,
+			     std::vector<uint64_t> *theirs,
+			     int timeout_ms = 10000);
+
+	bool leader() const { return is_leader; }
+	const session_stats &peer() const { return peer_stats; }
+	const clock_estimate &clock() const { return estimate; }
+
+	/* a peer timestamp on the local clock */
+	uint64_t to_local(uint64_t peer_ns) const
+	{ return peer_ns - estimate.offset_at(peer_ns - estimate.offset_ns); }
+
+	void print_clock() const;
+
+	/* loss and throughput both ways, from both ends' counters */
+	static void print(const session_stats &local, const session_stats &peer);
+
+private:
+	bool send(uint8_t type, const std::vector<uint8_t> &payload);
+	bool receive(uint8_t *type, std::vector<uint8_t> *payload,
+		     int timeout_ms);
+	bool read_byte(uint8_t *c, int timeout_ms);
+	/* drops a partial frame left over from the last phase */
+	void new_phase();
+	bool agree(uint8_t type, const std::vector<uint8_t> &mine,
+		   std::vector<uint8_t> *theirs, int timeout_ms,
+		   bool speak = true);
+	bool linger(uint8_t type, uint8_t answer_type,
+		    const std::vector<uint8_t> &answer, int every);
+	void push_back(uint8_t type, std::vector<uint8_t> *payload);
+	/* time on the wire of a frame with len bytes of payload */
+	int wire_ms(size_t len) const;
+	int repeat_every(size_t len) const;
+	void add_cluster(const std::vector<int64_t> &offsets,
+			 const std::vector<uint64_t> &delays,
+			 const std::vector<uint64_t> &refs);
+
+	int fds;
+	session_config cfg;
+	uint32_t nonce;
+	bool is_leader;
+	session_stats peer_stats;
+	clock_estimate estimate;
+	/* first cluster, the estimate only keeps the last one */
+	clock_estimate first;
+
+	/* a frame that ended a phase, for the next one */
+	bool has_pending;
+	uint8_t pending_type;
+	std::vector<uint8_t> pending_payload;
+
+	/* the frame being read, past the sync, across receive() calls */
+	bool rx_in_frame;
+	uint8_t rx_prev;
+	std::vector<uint8_t> rx_frame;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __session_hh
@@ -0,0 +1,87 @@
+#ifndef __shmstats_hh
+#define __shmstats_hh
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "cacheline.hh"
+#include "stats.hh"
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Live counters of a tool in POSIX shared memory, for rtstat.
+ *
+ * Every port (a tester thread, i.e. one direction of a link) has a slot
+ * of its own, written by that thread only, under a seqlock: the sequence
+ * goes odd, the data is copied in, the sequence goes even. No syscall and
+ * no lock, so a publisher is never held up by a reader. Readers copy a
+ * slot and retry if the sequence was odd or moved meanwhile. The header
+ * carries a magic and layout version, readers refuse anything else.
+ */
+static const uint32_t shm_stats_magic = 0x4e535453;	/* "NSTS" */
+static const uint32_t shm_stats_version = 1;
+static const int shm_stats_ports = 8;
+
+struct shm_port {
+	char name[32];
+	char state[16];			/* running, reset, stopped ... */
+	uint64_t tx_packets;
+	uint64_t rx_packets;
+	uint64_t rx_errors;
+	uint64_t rx_missed;
+	uint64_t updated_ns;		/* monotonic_clock */
+	histogram latency;		/* whatever the tool measures */
+};
+
+struct shm_segment {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t pid;
+	uint64_t start_ns;
+	char tool[16];
+	std::atomic<uint32_t> num_ports;
+
+	struct alignas(cache_line_size) slot {
+		std::atomic<uint32_t> seq;
+		shm_port data;
+	} slots[shm_stats_ports];
+};
+
+class shm_stats
+{
+public:
+	shm_stats();
+	/* unmaps, the creator also removes the segment */
+	~shm_stats();
+
+	/* publisher, a fresh segment /name */
+	bool create(const std::string &name, const std::string &tool);
+	/* reader, read-only */
+	bool attach(const std::string &name);
+
+	/* publisher setup, the slot index or -1 when full */
+	int add_port(const std::string &name);
+	/* hot path, from the slot's own thread only */
+	void publish(int port, const shm_port &data);
+
+	/* a consistent copy, false if the publisher died mid write */
+	bool read(int port, shm_port *data) const;
+
+	bool valid() const { return seg != 0; }
+	const shm_segment *segment() const { return seg; }
+	int num_ports() const;
+
+private:
+	shm_segment *seg;
+	std::string path;
+	bool owner;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __shmstats_hh
@@ -0,0 +1,80 @@
+#ifndef __stats_hh
+#define __stats_hh
+
+#include <cstddef>
+#include <cstdint>
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Fixed size log-linear histogram for latencies in ns.
+ *
+ * Values below 2^sub_bits are exact, above that every power of 2 is split
+ * in 2^sub_bits buckets, so the error of a percentile is below 1/32
+ * (~3%). No allocation, adding a sample is a few instructions, so it can
+ * live in a realtime loop.
+ */
+class histogram
+{
+public:
+	static const int sub_bits = 5;
+	static const int sub_count = 1 << sub_bits;
+	static const int num_buckets = sub_count + (64 - sub_bits) * sub_count;
+
+	histogram() { reset(); }
+
+	void reset();
+
+	void add(uint64_t ns)
+	{
+		buckets[index(ns)]++;
+		samples++;
+		sum += ns;
+		if (ns < lo) lo = ns;
+		if (ns > hi) hi = ns;
+	}
+
+	void merge(const histogram &other);
+
+	uint64_t count() const { return samples; }
+	uint64_t min() const { return samples ? lo : 0; }
+	uint64_t max() const { return hi; }
+	double mean() const { return samples ? (double)sum / samples : 0; }
+	/* p in 0..100 */
+	uint64_t percentile(double p) const;
+
+	/*
+	 * Prints a single "title [us]: ..." line with min, p50, p90, p99,
+	 * p99.9 and max, in us, the same format for every tool.
+	 */
+	void print(const char *title) const;
+
+	static int index(uint64_t v)
+	{
+		if (v < (uint64_t)sub_count)
+			return v;
+
+		int e = 63 - __builtin_clzll(v);
+
+		return sub_count + (e - sub_bits) * sub_count +
+			(int)(v >> (e - sub_bits)) - sub_count;
+	}
+
+	/* middle of the bucket, representative value for percentiles */
+	static uint64_t value(int index);
+
+	uint64_t bucket(int index) const { return buckets[index]; }
+
+private:
+	uint64_t buckets[num_buckets];
+	uint64_t samples;
+	uint64_t sum;
+	uint64_t lo;
+	uint64_t hi;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __stats_hh
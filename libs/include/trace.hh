@@ -0,0 +1,164 @@
+#ifndef __trace_hh
+#define __trace_hh
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "clock.hh"
+
+using std::string;
+
+namespace nomovok {
+namespace util {
+
+/*
+ * Flight recorder
+ *
+ * A fixed size ring of binary records kept in a MAP_SHARED file mapping.
+ * Adding a record is a handful of stores into the page cache, no syscalls,
+ * and since the pages belong to the file they survive a crash of the
+ * process. On the first error the ring is frozen, so the file keeps the
+ * history that led to it, to be decoded offline by trd.
+ */
+
+enum trace_dir {
+	TRACE_NONE = 0,
+	TRACE_TX,
+	TRACE_RX,
+};
+
+enum trace_event {
+	TRACE_BYTE = 1,		/* value: the byte */
+	TRACE_BLOCK,		/* value: first 4 bytes, len: block size */
+	TRACE_ERROR,		/* value: received, aux: expected */
+	TRACE_RESET,		/* port has been reset */
+	TRACE_COUNTER,		/* value: trace_counter id, aux: count */
+	TRACE_FREEZE,		/* value: reason */
+	TRACE_MARK,		/* free for the application */
+};
+
+/* kernel uart counters, as from TIOCGICOUNT */
+enum trace_counter {
+	TRACE_CNT_RX = 0,
+	TRACE_CNT_TX,
+	TRACE_CNT_FRAME,
+	TRACE_CNT_OVERRUN,
+	TRACE_CNT_PARITY,
+	TRACE_CNT_BRK,
+	TRACE_CNT_BUF_OVERRUN,
+};
+
+struct trace_record {
+	uint64_t ts_ns;		/* monotonic_clock, ns */
+	uint32_t seq;		/* ring index + 1, stored last, 0 while busy */
+	uint8_t dir;
+	uint8_t event;
+	uint16_t len;
+	uint32_t value;
+	uint32_t aux;
+};
+
+static const char trace_magic[8] = { 'N', 'T', 'R', 'A', 'C', 'E', 0, 1 };
+static const uint32_t trace_version = 1;
+/* records start one page in, header is padded up to it */
+static const size_t trace_header_size = 4096;
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;		/* in records, power of 2 */
+	uint64_t clock_base_ns;		/* monotonic_clock at open */
+	std::atomic<uint64_t> head;	/* next index to be written */
+	std::atomic<uint32_t> frozen;	/* freeze reason, 0 if running */
+	uint32_t reserved;
+	uint64_t freeze_head;		/* head when frozen */
+	uint64_t freeze_ns;
+};
+
+class trace_ring
+{
+public:
+	trace_ring() : hdr(0), recs(0), mask(0), map_size(0), fds(-1) {}
+	~trace_ring();
+
+	/*
+	 * Creates (or truncates) the ring file, capacity is rounded up to
+	 * a power of 2. Returns false, leaving the recorder disabled,
+	 * if the file can't be mapped.
+	 */
+	bool open(const string &path, size_t records);
+	/* maps an existing ring file read-only, for decoders */
+	bool attach(const string &path);
+	void close();
+
+	bool enabled() const { return hdr != 0; }
+	bool frozen() const
+	{ return hdr && hdr->frozen.load(std::memory_order_relaxed); }
+
+	void record(trace_dir dir, trace_event event,
+		    uint32_t value, uint32_t aux = 0, uint16_t len = 0)
+	{
+		if (!hdr || hdr->frozen.load(std::memory_order_relaxed))
+			return;
+
+		append(dir, event, value, aux, len);
+	}
+
+	void record_block(trace_dir dir, const void *buf, size_t len);
+	/*
+	 * Snapshots the kernel uart counters of fd. This is an ioctl, so
+	 * meant for error paths only. Silently skipped on ttys without
+	 * TIOCGICOUNT (ptys, usb adapters), and once frozen.
+	 */
+	void record_counters(int fd);
+	/*
+	 * Stops recording, the first caller wins. Returns true if this
+	 * call froze the ring.
+	 */
+	bool freeze(uint32_t reason);
+
+	const trace_header *header() const { return hdr; }
+	/* bytes mapped, header and records */
+	size_t size() const { return map_size; }
+	const trace_record &at(uint64_t index) const
+	{ return recs[index & mask]; }
+	/* a record is valid if it has been completely written for index */
+	bool valid(uint64_t index) const
+	{ return at(index).seq == (uint32_t)(index + 1); }
+
+private:
+	/* what record() does once it's not frozen */
+	void append(trace_dir dir, trace_event event,
+		    uint32_t value, uint32_t aux, uint16_t len)
+	{
+		uint64_t i = hdr->head.fetch_add(1, std::memory_order_relaxed);
+		trace_record &r = recs[i & mask];
+
+		/* invalidate first, a decoder must not see half records */
+		__atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		r.ts_ns = monotonic_clock::now().time_since_epoch().count();
+		r.dir = dir;
+		r.event = event;
+		r.len = len;
+		r.value = value;
+		r.aux = aux;
+
+		__atomic_store_n(&r.seq, (uint32_t)(i + 1), __ATOMIC_RELEASE);
+	}
+
+	trace_header *hdr;
+	trace_record *recs;
+	uint64_t mask;
+	size_t map_size;
+	int fds;
+};
+
+} /* end of ns util */
+} /* end of ns nomovok */
+
+#endif // __trace_hh
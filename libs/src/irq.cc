@@ -0,0 +1,374 @@
+/*
+ * irq.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "irq.hh"
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+
+using namespace std;
+
+namespace nomovok {
+namespace util {
+
+static string read_line(const string &path)
+{
+	ifstream f(path);
+	string line;
+
+	getline(f, line);
+
+	return line;
+}
+
+static int read_int(const string &path)
+{
+	string s = read_line(path);
+
+	return s.empty() ? 0 : atoi(s.c_str());
+}
+
+static bool write_line(const string &path, const string &line)
+{
+	FILE *f = fopen(path.c_str(), "w");
+
+	if (!f) {
+		perror(("irq_tuning: can't open " + path).c_str());
+		return false;
+	}
+
+	bool ok = fputs(line.c_str(), f) >= 0;
+
+	/* errors of a proc write only show up on the flush */
+	if (fclose(f) != 0 || !ok) {
+		perror(("irq_tuning: can't write " + path).c_str());
+		return false;
+	}
+
+	return true;
+}
+
+string cpu_list(const cpu_set_t &set)
+{
+	ostringstream ss;
+	const char *sep = "";
+
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+
+		int last = cpu;
+
+		while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &set))
+			last++;
+
+		ss << sep << cpu;
+		if (last > cpu)
+			ss << "-" << last;
+
+		sep = ",";
+		cpu = last;
+	}
+
+	return ss.str();
+}
+
+/* "ttyS0" from "/dev/ttyS0", "/dev/serial/by-id/..." or "ttyS0" */
+static string tty_name(const string &device)
+{
+	char path[PATH_MAX];
+
+	if (!realpath(device.c_str(), path))
+		return device;
+
+	string p = path;
+
+	if (p.compare(0, 5, "/dev/") == 0)
+		return p.substr(5);
+
+	return p;
+}
+
+/*
+ * 8250 ports have their irq right in the tty class directory, others
+ * (usb, pci cards) on one of the devices above it.
+ */
+static void sysfs_irqs(const string &tty, vector<int> *irqs)
+{
+	int irq = read_int("/sys/class/tty/" + tty + "/irq");
+
+	if (irq > 0) {
+		irqs->push_back(irq);
+		return;
+	}
+
+	char path[PATH_MAX];
+
+	if (!realpath(("/sys/class/tty/" + tty + "/device").c_str(), path))
+		return;
+
+	for (string dir = path; dir.size() > strlen("/sys/devices");
+	     dir = dir.substr(0, dir.rfind('/'))) {
+		irq = read_int(dir + "/irq");
+		if (irq > 0) {
+			irqs->push_back(irq);
+			return;
+		}
+	}
+}
+
+/* lines of /proc/interrupts with an action named as the tty */
+static void proc_irqs(const string &tty, vector<int> *irqs)
+{
+	ifstream f("/proc/interrupts");
+	string line;
+
+	while (getline(f, line)) {
+		istringstream ss(line);
+		string tok;
+		int irq;
+
+		if (!(ss >> irq))
+			continue;
+
+		while (ss >> tok) {
+			if (!tok.empty() && tok.back() == ',')
+				tok.pop_back();
+			if (tok == tty) {
+				irqs->push_back(irq);
+				break;
+			}
+		}
+	}
+}
+
+static bool read_thread(pid_t pid, irq_thread *t)
+{
+	struct sched_param param;
+
+	t->pid = pid;
+	t->policy = sched_getscheduler(pid);
+	if (t->policy == -1 || sched_getparam(pid, &param) == -1 ||
+	    sched_getaffinity(pid, sizeof(t->cpus), &t->cpus) == -1)
+		return false;
+
+	t->prio = param.sched_priority;
+	t->comm = read_line("/proc/" + to_string(pid) + "/comm");
+
+	return true;
+}
+
+/*
+ * The handler threads are named irq/NN-action, forced threaded secondary
+ * handlers irqs/NN-action.
+ */
+static void irq_threads(int irq, vector<irq_thread> *threads)
+{
+	DIR *d = opendir("/proc");
+	struct dirent *e;
+
+	if (!d) {
+		perror("irq_tuning: can't open /proc");
+		return;
+	}
+
+	while ((e = readdir(d))) {
+		if (!isdigit(e->d_name[0]))
+			continue;
+
+		string comm = read_line(string("/proc/") + e->d_name + "/comm");
+		int n;
+
+		if (sscanf(comm.c_str(), "irq/%d-", &n) != 1 &&
+		    sscanf(comm.c_str(), "irqs/%d-", &n) != 1)
+			continue;
+		if (n != irq)
+			continue;
+
+		irq_thread t;
+
+		if (read_thread(atoi(e->d_name), &t))
+			threads->push_back(t);
+	}
+
+	closedir(d);
+}
+
+bool irq_tuning::find(const string &device)
+{
+	vector<int> irqs;
+
+	restore();
+	found.clear();
+
+	tty = tty_name(device);
+
+	sysfs_irqs(tty, &irqs);
+	proc_irqs(tty, &irqs);
+
+	sort(irqs.begin(), irqs.end());
+	irqs.erase(unique(irqs.begin(), irqs.end()), irqs.end());
+
+	for (int irq : irqs) {
+		irq_line l;
+
+		l.irq = irq;
+		l.cpus = read_line("/proc/irq/" + to_string(irq) +
+			"/smp_affinity_list");
+		irq_threads(irq, &l.threads);
+
+		found.push_back(l);
+	}
+
+	if (found.empty()) {
+		fprintf(stderr, "irq_tuning: no irq found for %s\n",
+			tty.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+size_t irq_tuning::num_threads() const
+{
+	size_t n = 0;
+
+	for (const irq_line &l : found)
+		n += l.threads.size();
+
+	return n;
+}
+
+bool irq_tuning::set_priority(int prio)
+{
+	struct sched_param param;
+	bool ok = true;
+
+	param.sched_priority = prio;
+
+	for (const irq_line &l : found) {
+		for (const irq_thread &t : l.threads) {
+			if (sched_setscheduler(t.pid, SCHED_FIFO, &param) == -1) {
+				perror("irq_tuning::set_priority(): failed");
+				ok = false;
+				continue;
+			}
+			prio_changed = true;
+		}
+	}
+
+	return ok;
+}
+
+bool irq_tuning::set_affinity(int cpu)
+{
+	cpu_set_t set;
+	bool ok = true;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	for (const irq_line &l : found) {
+		/*
+		 * The kernel moves the irq thread along on the next
+		 * interrupt, do it now so the layout is right from the start.
+		 */
+		if (!write_line("/proc/irq/" + to_string(l.irq) +
+				"/smp_affinity_list", to_string(cpu))) {
+			ok = false;
+			continue;
+		}
+		affinity_changed = true;
+
+		for (const irq_thread &t : l.threads) {
+			if (sched_setaffinity(t.pid, sizeof(set), &set) == -1) {
+				perror("irq_tuning::set_affinity(): failed");
+				ok = false;
+			}
+		}
+	}
+
+	return ok;
+}
+
+void irq_tuning::restore()
+{
+	for (const irq_line &l : found) {
+		if (affinity_changed && !l.cpus.empty())
+			write_line("/proc/irq/" + to_string(l.irq) +
+				"/smp_affinity_list", l.cpus);
+
+		for (const irq_thread &t : l.threads) {
+			struct sched_param param;
+
+			param.sched_priority = t.prio;
+
+			if (prio_changed &&
+			    sched_setscheduler(t.pid, t.policy, &param) == -1)
+				perror("irq_tuning::restore(): priority");
+			if (affinity_changed &&
+			    sched_setaffinity(t.pid, sizeof(t.cpus), &t.cpus) == -1)
+				perror("irq_tuning::restore(): affinity");
+		}
+	}
+
+	prio_changed = false;
+	affinity_changed = false;
+}
+
+static const char *policy_name(int policy)
+{
+	switch (policy) {
+	case SCHED_FIFO:
+		return "SCHED_FIFO";
+	case SCHED_RR:
+		return "SCHED_RR";
+	case SCHED_OTHER:
+		return "SCHED_OTHER";
+	default:
+		return "?";
+	}
+}
+
+void irq_tuning::print() const
+{
+	for (const irq_line &l : found) {
+		printf("irq %d (%s): cpus %s\n", l.irq, tty.c_str(),
+			read_line("/proc/irq/" + to_string(l.irq) +
+				"/smp_affinity_list").c_str());
+
+		if (l.threads.empty())
+			printf("  no irq thread, handled in hard irq context\n");
+
+		for (const irq_thread &saved : l.threads) {
+			irq_thread t;
+
+			if (!read_thread(saved.pid, &t)) {
+				printf("  %s [%d]: gone\n", saved.comm.c_str(),
+					saved.pid);
+				continue;
+			}
+
+			printf("  %s [%d]: %s %d, cpus %s\n", t.comm.c_str(),
+				t.pid, policy_name(t.policy), t.prio,
+				cpu_list(t.cpus).c_str());
+		}
+	}
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
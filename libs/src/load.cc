@@ -0,0 +1,487 @@
+/*
+ * load.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "load.hh"
+#include "irq.hh"
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace nomovok {
+namespace util {
+
+static const uint64_t period_ns = 10000000;
+static const size_t default_size = 16 << 20;
+static const size_t chunk_size = 64 << 10;
+static const size_t mem_chunk = 1 << 20;
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* "0-3,6" */
+static bool parse_cpus(const std::string &list, cpu_set_t *set)
+{
+	std::stringstream ss(list);
+	std::string range;
+
+	CPU_ZERO(set);
+
+	while (getline(ss, range, ',')) {
+		int first, last;
+		char dash;
+		std::stringstream rs(range);
+
+		if (!(rs >> first))
+			return false;
+		last = first;
+		if (rs >> dash && (dash != '-' || !(rs >> last)))
+			return false;
+		if (first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+
+		for (int cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, set);
+	}
+
+	return CPU_COUNT(set) > 0;
+}
+
+/* 64K, 16M, 1G */
+static bool parse_size(const std::string &s, size_t *size)
+{
+	char *end;
+	unsigned long long v = strtoull(s.c_str(), &end, 10);
+
+	switch (*end) {
+	case 'G': case 'g': v <<= 10; /* fall through */
+	case 'M': case 'm': v <<= 10; /* fall through */
+	case 'K': case 'k': v <<= 10; ++end; break;
+	}
+
+	if (end == s.c_str() || *end || !v)
+		return false;
+
+	*size = v;
+
+	return true;
+}
+
+static std::string size_name(size_t size)
+{
+	std::stringstream ss;
+
+	if (size % (1 << 20) == 0)
+		ss << (size >> 20) << "M";
+	else if (size % (1 << 10) == 0)
+		ss << (size >> 10) << "K";
+	else
+		ss << size;
+
+	return ss.str();
+}
+
+/* unit of what a kind counts */
+static const char *unit(const std::string &kind)
+{
+	if (kind == "cpu")
+		return "kloops";
+	if (kind == "mem")
+		return "MB copied";
+	if (kind == "fault")
+		return "page faults";
+	if (kind == "fork")
+		return "forks";
+	return "KB moved";
+}
+
+load_generator::load_generator() :
+	counters(0),
+	num_counters(0),
+	start_ns(0),
+	stop_ns(0)
+{
+	sched_getaffinity(0, sizeof(default_cpus), &default_cpus);
+}
+
+load_generator::~load_generator()
+{
+	stop();
+
+	if (counters)
+		munmap(counters, num_counters * sizeof(*counters));
+}
+
+bool load_generator::parse(const std::string &profile)
+{
+	std::stringstream ss(profile);
+	std::string item;
+
+	while (getline(ss, item, '+')) {
+		load_spec spec;
+		size_t pos = item.find_first_of(":@%/");
+
+		spec.kind = item.substr(0, pos);
+		spec.workers = 1;
+		spec.duty = 100;
+		spec.size = spec.kind == "mem" || spec.kind == "fault" ?
+			default_size : chunk_size;
+		spec.pinned = false;
+		CPU_ZERO(&spec.cpus);
+
+		if (spec.kind != "cpu" && spec.kind != "mem" &&
+		    spec.kind != "fault" && spec.kind != "fork" &&
+		    spec.kind != "ipc" && spec.kind != "net") {
+			fprintf(stderr, "load: unknown kind in \"%s\"\n",
+				item.c_str());
+			return false;
+		}
+
+		while (pos != std::string::npos) {
+			const char tag = item[pos];
+			const size_t next = item.find_first_of(":@%/", pos + 1);
+			const std::string value =
+				item.substr(pos + 1, next - pos - 1);
+			bool ok = true;
+
+			switch (tag) {
+			case ':':
+				spec.workers = atoi(value.c_str());
+				ok = spec.workers > 0;
+				break;
+			case '@':
+				ok = spec.pinned = parse_cpus(value, &spec.cpus);
+				break;
+			case '%':
+				spec.duty = atoi(value.c_str());
+				ok = spec.duty > 0 && spec.duty <= 100;
+				break;
+			case '/':
+				ok = parse_size(value, &spec.size);
+				break;
+			}
+
+			if (!ok) {
+				fprintf(stderr, "load: bad \"%c%s\" in \"%s\"\n",
+					tag, value.c_str(), item.c_str());
+				return false;
+			}
+			pos = next;
+		}
+
+		specs.push_back(spec);
+	}
+
+	return true;
+}
+
+void load_generator::set_cpus(const cpu_set_t &cpus)
+{
+	default_cpus = cpus;
+}
+
+std::string load_generator::profile() const
+{
+	std::stringstream ss;
+	const char *sep = "";
+
+	if (specs.empty())
+		return "none";
+
+	for (const auto &s : specs) {
+		ss << sep << s.kind << ":" << s.workers << "@"
+			<< cpu_list(s.pinned ? s.cpus : default_cpus)
+			<< "%" << s.duty;
+		if (s.kind != "cpu" && s.kind != "fork")
+			ss << "/" << size_name(s.size);
+		sep = "+";
+	}
+
+	return ss.str();
+}
+
+/*
+ * A stream socket or pipe pair, the read end drained by a thread. The
+ * write end is non-blocking, a full pipe must not hold the worker past
+ * its busy time.
+ */
+static int flood_fd(bool net)
+{
+	int fds[2];
+
+	if (!net) {
+		if (pipe(fds) == -1)
+			return -1;
+	} else {
+		struct sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		int l = socket(AF_INET, SOCK_STREAM, 0);
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (l == -1 || bind(l, (struct sockaddr *)&addr, len) == -1 ||
+		    listen(l, 1) == -1 ||
+		    getsockname(l, (struct sockaddr *)&addr, &len) == -1)
+			return -1;
+
+		fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+		if (fds[1] == -1 ||
+		    connect(fds[1], (struct sockaddr *)&addr, len) == -1)
+			return -1;
+		fds[0] = accept(l, 0, 0);
+		close(l);
+		if (fds[0] == -1)
+			return -1;
+	}
+
+	const int rx = fds[0];
+
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+		return -1;
+
+	std::thread([rx] {
+		static char buf[chunk_size];
+
+		while (read(rx, buf, sizeof(buf)) > 0)
+			;
+	}).detach();
+
+	return fds[1];
+}
+
+/* waits for fd to take more, at most until deadline, the ns waited */
+static uint64_t wait_writable(int fd, uint64_t deadline)
+{
+	const uint64_t start = now_ns();
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	struct timespec ts;
+
+	if (start >= deadline)
+		return 0;
+
+	ts.tv_sec = (deadline - start) / 1000000000;
+	ts.tv_nsec = (deadline - start) % 1000000000;
+	ppoll(&pfd, 1, &ts, 0);
+
+	return now_ns() - start;
+}
+
+/* runs in the worker process, until killed */
+void load_generator::worker(const load_spec &spec, std::atomic<uint64_t> *ops)
+{
+	const uint64_t busy_ns = period_ns * spec.duty / 100;
+	char *src = 0, *dst = 0;
+	size_t off = 0;
+	int fd = -1;
+	const long page = sysconf(_SC_PAGESIZE);
+
+	if (spec.kind == "mem" || spec.kind == "fault") {
+		src = (char *)mmap(0, spec.size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (src == MAP_FAILED)
+			_exit(1);
+	}
+	if (spec.kind == "mem") {
+		dst = (char *)mmap(0, spec.size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (dst == MAP_FAILED)
+			_exit(1);
+		memset(src, 1, spec.size);
+		memset(dst, 2, spec.size);
+	}
+	if (spec.kind == "ipc" || spec.kind == "net") {
+		fd = flood_fd(spec.kind == "net");
+		if (fd == -1) {
+			perror("load: can't set up the flood");
+			_exit(1);
+		}
+		src = (char *)calloc(1, spec.size);
+	}
+
+	for (;;) {
+		const uint64_t start = now_ns();
+		uint64_t done = 0;
+		/* waited for the reader, not busy */
+		uint64_t idle = 0;
+
+		while (now_ns() - start - idle < busy_ns) {
+			if (spec.kind == "cpu") {
+				for (volatile int i = 0; i < 1000; ++i)
+					;
+				done++;
+			} else if (spec.kind == "mem") {
+				const size_t n = spec.size - off < mem_chunk ?
+					spec.size - off : mem_chunk;
+
+				memcpy(dst + off, src + off, n);
+				off = off + n == spec.size ? 0 : off + n;
+				done++;
+			} else if (spec.kind == "fault") {
+				src[off] = 1;
+				off += page;
+				if (off >= spec.size) {
+					madvise(src, spec.size, MADV_DONTNEED);
+					off = 0;
+				}
+				done++;
+			} else if (spec.kind == "fork") {
+				pid_t pid = fork();
+
+				if (pid == 0) {
+					execl("/bin/true", "true", (char *)0);
+					_exit(0);
+				}
+				if (pid > 0)
+					waitpid(pid, 0, 0);
+				done++;
+			} else {
+				ssize_t n = write(fd, src, spec.size);
+
+				if (n > 0)
+					done += n >> 10;
+				else if (n == -1 && errno == EAGAIN)
+					idle += wait_writable(fd,
+						start + period_ns);
+				if (now_ns() - start >= period_ns)
+					break;
+			}
+		}
+
+		ops->fetch_add(done, std::memory_order_relaxed);
+
+		const uint64_t spent = now_ns() - start;
+
+		if (spent < period_ns) {
+			struct timespec ts = { 0, (long)(period_ns - spent) };
+
+			nanosleep(&ts, 0);
+		}
+	}
+}
+
+bool load_generator::start()
+{
+	if (specs.empty() || !pids.empty())
+		return true;
+
+	if (!counters) {
+		num_counters = specs.size();
+		void *p = mmap(0, num_counters * sizeof(*counters),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+
+		if (p == MAP_FAILED) {
+			perror("load: mmap failed");
+			return false;
+		}
+		counters = (std::atomic<uint64_t> *)p;
+	}
+
+	for (size_t i = 0; i < num_counters; ++i)
+		counters[i].store(0);
+
+	/* nothing buffered twice by the children */
+	fflush(stdout);
+	fflush(stderr);
+
+	for (size_t i = 0; i < specs.size(); ++i) {
+		const load_spec &spec = specs[i];
+
+		for (int w = 0; w < spec.workers; ++w) {
+			pid_t pid = fork();
+
+			if (pid == -1) {
+				perror("load: fork failed");
+				stop();
+				return false;
+			}
+			if (pid > 0) {
+				pids.push_back(pid);
+				continue;
+			}
+
+			struct sched_param param;
+
+			param.sched_priority = 0;
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			sched_setscheduler(0, SCHED_OTHER, &param);
+			sched_setaffinity(0, sizeof(cpu_set_t),
+				spec.pinned ? &spec.cpus : &default_cpus);
+			munlockall();
+
+			worker(spec, &counters[i]);
+			_exit(0);
+		}
+	}
+
+	start_ns = now_ns();
+	stop_ns = 0;
+
+	return true;
+}
+
+void load_generator::stop()
+{
+	if (pids.empty())
+		return;
+
+	for (pid_t pid : pids)
+		kill(pid, SIGKILL);
+	for (pid_t pid : pids)
+		waitpid(pid, 0, 0);
+
+	pids.clear();
+	stop_ns = now_ns();
+}
+
+void load_generator::print() const
+{
+	const uint64_t end = stop_ns ? stop_ns : now_ns();
+	const double seconds = (end - start_ns) / 1e9;
+
+	printf("==== load ====\n");
+	printf("Load = %s\n", profile().c_str());
+
+	if (!counters || !start_ns || seconds <= 0)
+		return;
+
+	for (size_t i = 0; i < specs.size(); ++i) {
+		const uint64_t ops = counters[i].load();
+
+		printf("%-5s %" PRIu64 " %s, %.0f/s\n", specs[i].kind.c_str(),
+			ops, unit(specs[i].kind), ops / seconds);
+	}
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
@@ -13,10 +13,16 @@
 #include <cstring>
 #include <cinttypes>
 #include <cassert>
+#include <atomic>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
 
 #include <sched.h>
 #include <unistd.h>
+#include <alloca.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>
@@ -34,6 +40,59 @@ namespace util {
  */
 typedef uint64_t rlim_t;
 static const rlim_t cpu_limit_us = 3000000;
+
+static rt_memory memory_mode = RT_MEMORY_ALL;
+/* what has been locked on request since rt_init(), in budget mode */
+static std::atomic<size_t> locked_bytes(0);
+/* rt_alloc() buffers that got locked, by address, and how much */
+static std::mutex regions_lock;
+static std::map<uintptr_t, size_t> locked_regions;
+
+/* within a locked rt_alloc() buffer, e.g. an rt_thread_stack() */
+static bool in_locked_region(const void *p, size_t size)
+{
+	std::lock_guard<std::mutex> guard(regions_lock);
+	auto it = locked_regions.upper_bound((uintptr_t)p);
+
+	if (it == locked_regions.begin())
+		return false;
+	--it;
+
+	return (uintptr_t)p + size <= it->first + it->second;
+}
+
+/* what mlock() locks for a region, the whole pages it touches */
+static size_t locked_span(const void *p, size_t size)
+{
+	const uintptr_t page = sysconf(_SC_PAGESIZE);
+	const uintptr_t start = (uintptr_t)p & ~(page - 1);
+	const uintptr_t end = ((uintptr_t)p + size + page - 1) & ~(page - 1);
+
+	return end - start;
+}
+
+/*
+ * The stack top a thread prefaulted and locked in budget mode, given
+ * back when the thread exits. A later rt_stack_prefault() of the same
+ * thread replaces it.
+ */
+struct prefaulted_stack {
+	const void *p;
+	size_t size;
+
+	prefaulted_stack() : p(0), size(0) {}
+	~prefaulted_stack() { release(); }
+
+	void release()
+	{
+		if (p)
+			rt_unlock(p, size);
+		p = 0;
+	}
+};
+
+static thread_local prefaulted_stack prefaulted;
+
 /*
  * Sets the CPU limit of a task.  0 means self.
  */
@@ -61,18 +120,29 @@ void rt_set_cpu_limit_or_die(pid_t pid, rlim_t limit)
  * in scheduling decisions (it must be specified as 0).
  *
  */
-void rt_init()
+void rt_init(rt_memory mode)
 {
 	/*
 	 * 1st - lock memory to stay into RAM, no swap
 	 * avoid page faults and related handling
 	 *
+	 * In budget mode only what is there now, code and data mostly,
+	 * anything later is locked as asked for.
 	 */
-        if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+	const int flags = mode == RT_MEMORY_ALL ?
+		MCL_CURRENT | MCL_FUTURE : MCL_CURRENT;
+
+	memory_mode = mode;
+
+        if(mlockall(flags) == -1) {
                 perror("init_realtime(): mlockall failed");
                 exit(-2);
         }
 
+	if (mode == RT_MEMORY_BUDGET)
+		cout << "rt_init(): memory budget mode, "
+			"later mappings locked on request only\n";
+
         rt_stack_prefault();
 
 
@@ -113,19 +183,208 @@ void rt_init()
 }
 
 /*
- * The maximum stack size which is
- * guaranteed safe to access without
- * faulting
+ * Touches the next size bytes of the calling thread's stack, so they
+ * don't fault later. In budget mode they are locked as well, under
+ * MCL_FUTURE the whole stack is.
  */
-static const int max_safe_stack = 8 * 1024;
+void rt_stack_prefault(size_t size)
+{
+	unsigned char *dummy = (unsigned char *)alloca(size);
+
+	memset(dummy, 0, size);
+	/* not a dead store to the compiler */
+	asm volatile("" : : "r"(dummy) : "memory");
+
+	if (memory_mode != RT_MEMORY_BUDGET || in_locked_region(dummy, size))
+		return;
+
+	prefaulted.release();
+	if (rt_lock(dummy, size)) {
+		prefaulted.p = dummy;
+		prefaulted.size = size;
+	}
+}
+
+static size_t read_hugepage_size()
+{
+	ifstream meminfo("/proc/meminfo");
+	string key;
+	size_t kb;
+
+	while (meminfo >> key >> kb) {
+		if (key == "Hugepagesize:")
+			return kb * 1024;
+		meminfo.ignore(256, '\n');
+	}
+
+	return 0;
+}
+
+/* 0 without hugepage support, read once by whichever thread asks first */
+static size_t hugepage_size()
+{
+	static const size_t size = read_hugepage_size();
+
+	return size;
+}
+
+static bool use_hugepages(size_t size)
+{
+	const size_t huge = hugepage_size();
+
+	return huge && size >= huge;
+}
+
+/* what rt_alloc() maps for size, whole (huge)pages */
+static size_t alloc_size(size_t size)
+{
+	const size_t unit = use_hugepages(size) ?
+		hugepage_size() : sysconf(_SC_PAGESIZE);
+
+	return (size + unit - 1) / unit * unit;
+}
+
+void *rt_alloc(size_t size)
+{
+	const size_t len = alloc_size(size);
+	const long page = sysconf(_SC_PAGESIZE);
+	void *p = MAP_FAILED;
+
+	/* reserved hugetlbfs pages first, there may be none */
+	if (use_hugepages(size))
+		p = mmap(0, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (p == MAP_FAILED && use_hugepages(size)) {
+		/* THP only backs hugepage aligned ranges */
+		const size_t huge = hugepage_size();
+		char *raw = (char *)mmap(0, len + huge, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (raw != MAP_FAILED) {
+			char *aligned = (char *)(((uintptr_t)raw + huge - 1) &
+				~(uintptr_t)(huge - 1));
+
+			if (aligned > raw)
+				munmap(raw, aligned - raw);
+			munmap(aligned + len, raw + huge - aligned);
+			madvise(aligned, len, MADV_HUGEPAGE);
+			p = aligned;
+		}
+	}
 
-void rt_stack_prefault()
+	if (p == MAP_FAILED)
+		p = mmap(0, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (p == MAP_FAILED) {
+		perror("rt_alloc(): mmap failed");
+		return 0;
+	}
+
+	/* written, not read, or they'd all map the zero page */
+	for (size_t off = 0; off < len; off += page)
+		((volatile char *)p)[off] = 0;
+
+	/* MCL_FUTURE has it locked already */
+	if (memory_mode == RT_MEMORY_BUDGET && rt_lock(p, len)) {
+		std::lock_guard<std::mutex> guard(regions_lock);
+
+		locked_regions[(uintptr_t)p] = len;
+	}
+
+	return p;
+}
+
+void rt_free(void *p, size_t size)
 {
-	unsigned char dummy[max_safe_stack];
+	if (!p)
+		return;
 
-        memset(dummy, 0, max_safe_stack);
+	const size_t len = alloc_size(size);
+
+	{
+		std::lock_guard<std::mutex> guard(regions_lock);
+		auto it = locked_regions.find((uintptr_t)p);
+
+		/* only what rt_lock() counted */
+		if (it != locked_regions.end()) {
+			locked_bytes -= it->second;
+			locked_regions.erase(it);
+		}
+	}
+
+	munmap(p, len);
+}
+
+bool rt_lock(const void *p, size_t size)
+{
+	if (mlock(p, size) == -1) {
+		perror("rt_lock(): mlock failed");
+		return false;
+	}
+
+	locked_bytes += locked_span(p, size);
+
+	return true;
+}
+
+void rt_unlock(const void *p, size_t size)
+{
+	if (munlock(p, size) == -1) {
+		perror("rt_unlock(): munlock failed");
+		return;
+	}
 
-        return;
+	locked_bytes -= locked_span(p, size);
+}
+
+void *rt_thread_stack(pthread_attr_t *attr, size_t size)
+{
+	void *stack = rt_alloc(size);
+
+	if (!stack)
+		return 0;
+
+	int err = pthread_attr_setstack(attr, stack, alloc_size(size));
+
+	if (err) {
+		errno = err;
+		perror("rt_thread_stack(): can't set the stack");
+		rt_free(stack, size);
+		return 0;
+	}
+
+	return stack;
+}
+
+/* a "kB" line of /proc/self/status */
+static size_t status_kb(const string &name)
+{
+	ifstream status("/proc/self/status");
+	string line;
+
+	while (getline(status, line))
+		if (line.compare(0, name.size() + 1, name + ":") == 0)
+			return strtoul(line.c_str() + name.size() + 1, 0, 10);
+
+	return 0;
+}
+
+void rt_memory_report(const char *when)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	cout << "rt_memory(" << when << "): locked "
+		<< status_kb("VmLck") << " kB";
+	if (memory_mode == RT_MEMORY_BUDGET)
+		cout << " (asked " << locked_bytes / 1024 << " kB)";
+	cout << ", rss " << status_kb("VmRSS") << " kB"
+		<< ", hugetlb " << status_kb("HugetlbPages") << " kB"
+		<< ", faults maj:" << usage.ru_majflt
+		<< ", min: " << usage.ru_minflt << "\n";
 }
 
 /*
@@ -174,20 +433,28 @@ void rt_set_thread_prio_or_die(int value)
 }
 
 /*
- * this function migrate the process to desired cpu
+ * this function migrate the calling thread to desired cpu
  */
-void rt_set_processor_affinity(int core_id)
+bool rt_set_processor_affinity(int core_id)
 {
 	cpu_set_t cpuset;
+	int err;
 
 	CPU_ZERO(&cpuset);
 	CPU_SET(core_id, &cpuset);
 
 	pthread_t current_thread = pthread_self();
-	assert(pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset)
-		== 0);
+	err = pthread_setaffinity_np(current_thread, sizeof(cpu_set_t), &cpuset);
+	if (err) {
+		errno = err;
+		perror("rt_set_processor_affinity(): failed");
+		return false;
+	}
+
+	cout << "pinned task " << syscall(SYS_gettid) << " to core " << core_id
+		<< "\n";
 
-	cout << "pinned task " << syscall(SYS_gettid) << " to core " << core_id;
+	return true;
 }
 
 } /* end of ns util */
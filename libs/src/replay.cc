@@ -0,0 +1,149 @@
+/*
+ * replay.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "replay.hh"
+#include "serial.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+namespace nomovok {
+namespace util {
+
+bool replay::load_trace(const string &path, trace_dir dir)
+{
+	trace_ring ring;
+
+	data.clear();
+	offset_ns.clear();
+	skipped_records = 0;
+
+	if (!ring.attach(path))
+		return false;
+
+	const trace_header *h = ring.header();
+	uint64_t end = h->frozen.load() ? h->freeze_head : h->head.load();
+	uint64_t begin = end > h->capacity ? end - h->capacity : 0;
+	uint64_t first_ns = 0;
+
+	for (uint64_t i = begin; i < end; ++i) {
+		if (!ring.valid(i))
+			continue;
+
+		const trace_record &r = ring.at(i);
+
+		if (r.dir != dir)
+			continue;
+		if (r.event == TRACE_BLOCK) {
+			skipped_records++;
+			continue;
+		}
+		if (r.event != TRACE_BYTE)
+			continue;
+
+		if (data.empty())
+			first_ns = r.ts_ns;
+
+		data.push_back(r.value);
+		offset_ns.push_back(r.ts_ns - first_ns);
+	}
+
+	return true;
+}
+
+bool replay::load_raw(const string &path, int baud_rate)
+{
+	std::ifstream f(path.c_str(), std::ios::binary);
+
+	data.clear();
+	offset_ns.clear();
+	skipped_records = 0;
+
+	if (!f) {
+		fprintf(stderr, "replay::load_raw(): can't open %s\n",
+			path.c_str());
+		return false;
+	}
+
+	data.assign(std::istreambuf_iterator<char>(f),
+		    std::istreambuf_iterator<char>());
+
+	/* 8N1, 10 bits on the wire per byte */
+	const double byte_ns = 10 * 1e9 / baud_rate;
+
+	offset_ns.resize(data.size());
+	for (size_t i = 0; i < data.size(); ++i)
+		offset_ns[i] = i * byte_ns;
+
+	return true;
+}
+
+double replay::duration() const
+{
+	if (offset_ns.empty())
+		return 0;
+
+	return offset_ns.back() / 1e9;
+}
+
+static inline bool stopped(const stop_token *stop)
+{
+	return stop && stop->stop_requested();
+}
+
+void replay::run(int fd, double speed, const stop_token *stop,
+		 histogram *lateness) const
+{
+	if (data.empty())
+		return;
+
+	if (speed <= 0) {
+		size_t done = 0;
+
+		while (done < data.size() && !stopped(stop)) {
+			ssize_t n = ::write(fd, &data[done], data.size() - done);
+
+			if (n > 0)
+				done += n;
+			else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+				perror("replay::run(): write failed");
+				return;
+			}
+		}
+		return;
+	}
+
+	const auto start = monotonic_clock::now();
+
+	for (size_t i = 0; i < data.size() && !stopped(stop); ) {
+		/* bytes sharing the timestamp go out in one write */
+		size_t n = 1;
+
+		while (i + n < data.size() && offset_ns[i + n] == offset_ns[i])
+			n++;
+
+		const auto when = start + std::chrono::nanoseconds(
+			(uint64_t)(offset_ns[i] / speed));
+		const auto sent = write_paced(fd, &data[i], n, when);
+
+		if (sent == monotonic_clock::time_point())
+			return;
+
+		if (lateness)
+			lateness->add(sent > when ? (sent - when).count() : 0);
+
+		i += n;
+	}
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
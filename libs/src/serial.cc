@@ -12,6 +12,7 @@
 #include <cerrno>
 #include <cstring>
 #include <sstream>
+#include <thread>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -133,6 +134,47 @@ void serial::flush()
 	flush_output();
 }
 
+monotonic_clock::time_point serial::write_paced(const void *buf, size_t len,
+	const monotonic_clock::time_point &when)
+{
+	return util::write_paced(fds, buf, len, when);
+}
+
+/*
+ * Sleeping is only precise to the scheduler latency, so we sleep up to
+ * a short while before the deadline and spin the rest.
+ */
+static const std::chrono::microseconds pace_spin_window(200);
+
+monotonic_clock::time_point write_paced(int fd, const void *buf, size_t len,
+	const monotonic_clock::time_point &when)
+{
+	const char *p = (const char *)buf;
+	monotonic_clock::time_point sent;
+
+	if (monotonic_clock::now() < when - pace_spin_window)
+		std::this_thread::sleep_until(when - pace_spin_window);
+
+	while (monotonic_clock::now() < when)
+		;
+
+	while (len) {
+		ssize_t n = ::write(fd, p, len);
+
+		if (n > 0) {
+			if (sent == monotonic_clock::time_point())
+				sent = monotonic_clock::now();
+			p += n;
+			len -= n;
+		} else if (n == -1 && errno != EAGAIN && errno != EINTR) {
+			perror("write_paced(): write failed");
+			break;
+		}
+	}
+
+	return sent;
+}
+
 void serial::reset()
 {
 	if (fds) {
@@ -0,0 +1,264 @@
+/*
+ * serial_can.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "serial_io.hh"
+#include "realtime.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <net/if.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+namespace nomovok {
+namespace util {
+
+static const size_t ctrl_size = CMSG_SPACE(sizeof(struct timespec));
+
+static canid_t frame_id(uint32_t id)
+{
+	if (id > CAN_SFF_MASK)
+		return (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+
+	return id;
+}
+
+int can_open(const string &ifname, int64_t rx_id)
+{
+	struct sockaddr_can addr;
+	int on = 1;
+	int fd;
+
+	fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+	if (fd == -1) {
+		perror("can_open(): socket failed");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = if_nametoindex(ifname.c_str());
+	if (!addr.can_ifindex) {
+		perror(("can_open(): no interface " + ifname).c_str());
+		close(fd);
+		return -1;
+	}
+
+	/* no filter at all is a socket that only sends */
+	if (rx_id < 0) {
+		if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, 0, 0) == -1)
+			goto err;
+	} else {
+		struct can_filter f;
+
+		/* remote requests carry no data, the RTR bit keeps them out */
+		f.can_id = frame_id(rx_id);
+		f.can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+			(rx_id > CAN_SFF_MASK ? CAN_EFF_MASK : CAN_SFF_MASK);
+
+		if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FILTER, &f,
+			       sizeof(f)) == -1)
+			goto err;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1)
+		goto err;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		goto err;
+
+	return fd;
+err:
+	perror("can_open(): socket setup failed");
+	close(fd);
+
+	return -1;
+}
+
+can_backend::can_backend(int fd, uint32_t tx_id) :
+	fds(fd),
+	id(tx_id),
+	/* locked in budget mode */
+	rx_frames((struct can_frame *)rt_alloc(batch *
+		sizeof(struct can_frame))),
+	rx_ctrl((uint8_t *)rt_alloc(batch * ctrl_size)),
+	rx_count(0),
+	rx_idx(0),
+	rx_off(0),
+	num_tx(0),
+	num_rx(0),
+	num_tx_full(0)
+{
+}
+
+can_backend::~can_backend()
+{
+	rt_free(rx_frames, batch * sizeof(struct can_frame));
+	rt_free(rx_ctrl, batch * ctrl_size);
+}
+
+static uint64_t realtime_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* next batch of frames, with the kernel to user delay of each */
+bool can_backend::receive()
+{
+	struct mmsghdr msgs[batch];
+	struct iovec iov[batch];
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (int i = 0; i < batch; ++i) {
+		iov[i].iov_base = &rx_frames[i];
+		iov[i].iov_len = sizeof(struct can_frame);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = rx_ctrl + i * ctrl_size;
+		msgs[i].msg_hdr.msg_controllen = ctrl_size;
+	}
+
+	int n = recvmmsg(fds, msgs, batch, MSG_DONTWAIT, 0);
+
+	if (n <= 0)
+		return false;
+
+	const uint64_t now = realtime_ns();
+
+	for (int i = 0; i < n; ++i) {
+		struct msghdr *h = &msgs[i].msg_hdr;
+		struct cmsghdr *c;
+
+		for (c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c)) {
+			if (c->cmsg_level != SOL_SOCKET ||
+			    c->cmsg_type != SCM_TIMESTAMPNS)
+				continue;
+
+			struct timespec ts;
+
+			memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+
+			const uint64_t t = (uint64_t)ts.tv_sec * 1000000000 +
+				ts.tv_nsec;
+
+			if (t <= now)
+				delay.add(now - t);
+		}
+	}
+
+	num_rx += n;
+	rx_count = n;
+	rx_idx = 0;
+	rx_off = 0;
+
+	return true;
+}
+
+ssize_t can_backend::read(void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	size_t done = 0;
+
+	if (rx_idx == rx_count && !receive()) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		return -1;
+	}
+
+	/* frames split over two reads keep their tail for the next one */
+	while (done < len && rx_idx < rx_count) {
+		const struct can_frame &f = rx_frames[rx_idx];
+		size_t n = f.can_dlc - rx_off;
+
+		if (n > len - done)
+			n = len - done;
+
+		memcpy(p + done, f.data + rx_off, n);
+		done += n;
+		rx_off += n;
+
+		if (rx_off == f.can_dlc) {
+			rx_idx++;
+			rx_off = 0;
+		}
+	}
+
+	return done;
+}
+
+ssize_t can_backend::write(const void *buf, size_t len)
+{
+	struct can_frame frames[batch];
+	struct mmsghdr msgs[batch];
+	struct iovec iov[batch];
+	const uint8_t *p = (const uint8_t *)buf;
+	int count = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	while (len && count < batch) {
+		struct can_frame &f = frames[count];
+		const size_t n = len < CAN_MAX_DLEN ? len : CAN_MAX_DLEN;
+
+		memset(&f, 0, sizeof(f));
+		f.can_id = frame_id(id);
+		f.can_dlc = n;
+		memcpy(f.data, p, n);
+
+		iov[count].iov_base = &f;
+		iov[count].iov_len = sizeof(f);
+		msgs[count].msg_hdr.msg_iov = &iov[count];
+		msgs[count].msg_hdr.msg_iovlen = 1;
+
+		p += n;
+		len -= n;
+		count++;
+	}
+
+	int sent = sendmmsg(fds, msgs, count, MSG_DONTWAIT);
+
+	if (sent == -1) {
+		/* a full tx queue is ENOBUFS on most CAN drivers */
+		if (errno == EAGAIN || errno == ENOBUFS || errno == EINTR) {
+			num_tx_full++;
+			return 0;
+		}
+		return -1;
+	}
+
+	ssize_t bytes = 0;
+
+	for (int i = 0; i < sent; ++i)
+		bytes += frames[i].can_dlc;
+	num_tx += sent;
+
+	return bytes;
+}
+
+void can_backend::print_stats() const
+{
+	printf("can: %llu frames out, %llu in, tx queue full %llu times\n",
+		(unsigned long long)num_tx, (unsigned long long)num_rx,
+		(unsigned long long)num_tx_full);
+
+	if (delay.count())
+		delay.print("CAN kernel to user");
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
@@ -0,0 +1,394 @@
+/*
+ * serial_io.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "serial_io.hh"
+#include "cacheline.hh"
+#include "realtime.hh"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <new>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+namespace nomovok {
+namespace util {
+
+static ssize_t nonblocking(ssize_t n)
+{
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	return n;
+}
+
+ssize_t plain_backend::read(void *buf, size_t len)
+{
+	return nonblocking(::read(fds, buf, len));
+}
+
+ssize_t plain_backend::write(const void *buf, size_t len)
+{
+	return nonblocking(::write(fds, buf, len));
+}
+
+/* head and tail only ever grow, the writer owns one, the reader the other */
+struct loopback_backend::ring {
+	enum { size = 65536 };
+
+	alignas(cache_line_size) std::atomic<uint64_t> head;	/* written */
+	alignas(cache_line_size) std::atomic<uint64_t> tail;	/* read */
+	alignas(cache_line_size) uint8_t data[size];
+
+	ring() : head(0), tail(0) {}
+};
+
+loopback_backend::loopback_backend(int fd)
+{
+	static std::mutex lock;
+	static std::map<int, ring *> rings;
+	std::lock_guard<std::mutex> guard(lock);
+	ring *&found = rings[fd];
+
+	/*
+	 * cache line aligned, which plain new doesn't honour before C++17,
+	 * rt_alloc() pages are, and locked in budget mode
+	 */
+	if (!found) {
+		void *p = rt_alloc(sizeof(ring));
+
+		if (!p)
+			abort();
+		found = new (p) ring;
+	}
+
+	r = found;
+}
+
+ssize_t loopback_backend::read(void *buf, size_t len)
+{
+	const uint64_t tail = r->tail.load(std::memory_order_relaxed);
+	const uint64_t avail = r->head.load(std::memory_order_acquire) - tail;
+	const size_t n = len < avail ? len : avail;
+	const size_t off = tail & (ring::size - 1);
+	const size_t first = n < ring::size - off ? n : ring::size - off;
+
+	memcpy(buf, r->data + off, first);
+	memcpy((uint8_t *)buf + first, r->data, n - first);
+	r->tail.store(tail + n, std::memory_order_release);
+
+	return n;
+}
+
+ssize_t loopback_backend::write(const void *buf, size_t len)
+{
+	const uint64_t head = r->head.load(std::memory_order_relaxed);
+	const uint64_t room = ring::size -
+		(head - r->tail.load(std::memory_order_acquire));
+	const size_t n = len < room ? len : room;
+	const size_t off = head & (ring::size - 1);
+	const size_t first = n < ring::size - off ? n : ring::size - off;
+
+	memcpy(r->data + off, buf, first);
+	memcpy(r->data, (const uint8_t *)buf + first, n - first);
+	r->head.store(head + n, std::memory_order_release);
+
+	return n;
+}
+
+static int epoll_for(int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (epfd == -1) {
+		perror("epoll_backend: epoll_create1 failed");
+		return -1;
+	}
+
+	ev.events = events;
+	ev.data.fd = fd;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_backend: epoll_ctl failed");
+		close(epfd);
+		return -1;
+	}
+
+	return epfd;
+}
+
+/*
+ * One epoll instance per direction, level triggered, or the writer
+ * would be woken by every incoming byte and the other way around.
+ */
+epoll_backend::epoll_backend(int fd, int timeout_ms) :
+	fds(fd),
+	epfd_in(epoll_for(fd, EPOLLIN)),
+	epfd_out(epoll_for(fd, EPOLLOUT)),
+	timeout(timeout_ms)
+{
+}
+
+epoll_backend::~epoll_backend()
+{
+	if (epfd_in != -1)
+		close(epfd_in);
+	if (epfd_out != -1)
+		close(epfd_out);
+}
+
+bool epoll_backend::wait(int epfd)
+{
+	struct epoll_event ev;
+
+	return epoll_wait(epfd, &ev, 1, timeout) == 1;
+}
+
+ssize_t epoll_backend::read(void *buf, size_t len)
+{
+	if (!wait(epfd_in))
+		return 0;
+
+	return nonblocking(::read(fds, buf, len));
+}
+
+ssize_t epoll_backend::write(const void *buf, size_t len)
+{
+	if (!wait(epfd_out))
+		return 0;
+
+	return nonblocking(::write(fds, buf, len));
+}
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* retry a read every few pauses, a read(2) costs way more than a pause */
+static const int pauses_per_try = 8;
+/* thread cpu time is a syscall, the monotonic clock isn't */
+static const uint64_t cpu_sample_ns = 1000000;
+
+adaptive_backend::adaptive_backend(int fd, uint64_t spin_ns, int timeout_ms) :
+	fds(fd),
+	tuning(spin_ns == tune_window),
+	window(tuning ? 0 : spin_ns),
+	avg_wait(0),
+	timeout(timeout_ms),
+	num_immediate(0),
+	num_spin(0),
+	num_poll(0),
+	wall_start(0),
+	wall_last(0),
+	cpu_start(0),
+	cpu_last(0)
+{
+}
+
+void adaptive_backend::sample_cpu(uint64_t now)
+{
+	wall_last = now;
+	cpu_last = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	if (!wall_start) {
+		wall_start = wall_last;
+		cpu_start = cpu_last;
+	}
+}
+
+/*
+ * Moving average over 8 waits, reads served right away count as none.
+ * Spinning pays off only while the next byte is likely to be there
+ * within the window, twice the average wait.
+ */
+void adaptive_backend::observe(uint64_t wait_ns)
+{
+	if (!tuning)
+		return;
+
+	avg_wait += ((int64_t)wait_ns - (int64_t)avg_wait) / 8;
+	window = 2 * avg_wait <= max_spin_ns ? 2 * avg_wait : 0;
+}
+
+ssize_t adaptive_backend::read(void *buf, size_t len)
+{
+	const uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	uint64_t now = start;
+
+	/* on every path, spinning and immediate reads are the cpu hungry */
+	if (!wall_start || start - wall_last >= cpu_sample_ns)
+		sample_cpu(start);
+
+	ssize_t n = nonblocking(::read(fds, buf, len));
+
+	if (n) {
+		if (n > 0) {
+			num_immediate++;
+			observe(0);
+		}
+		return n;
+	}
+
+	while (now - start < window) {
+		for (int i = 0; i < pauses_per_try; ++i)
+			cpu_relax();
+
+		n = nonblocking(::read(fds, buf, len));
+		now = clock_ns(CLOCK_MONOTONIC);
+
+		if (n) {
+			if (n > 0) {
+				num_spin++;
+				observe(now - start);
+			}
+			return n;
+		}
+	}
+
+	struct pollfd pfd = { fds, POLLIN, 0 };
+
+	if (poll(&pfd, 1, timeout) != 1)
+		return 0;
+
+	n = nonblocking(::read(fds, buf, len));
+	if (n > 0) {
+		num_poll++;
+		observe(clock_ns(CLOCK_MONOTONIC) - start);
+	}
+
+	return n;
+}
+
+ssize_t adaptive_backend::write(const void *buf, size_t len)
+{
+	ssize_t n = nonblocking(::write(fds, buf, len));
+
+	if (n)
+		return n;
+
+	struct pollfd pfd = { fds, POLLOUT, 0 };
+
+	if (poll(&pfd, 1, timeout) != 1)
+		return 0;
+
+	return nonblocking(::write(fds, buf, len));
+}
+
+double adaptive_backend::cpu_load() const
+{
+	if (wall_last <= wall_start)
+		return 0;
+
+	return (double)(cpu_last - cpu_start) / (wall_last - wall_start);
+}
+
+void adaptive_backend::print_stats() const
+{
+	const uint64_t waits = num_spin + num_poll;
+
+	/* a TX side, nothing to tell */
+	if (!wall_start)
+		return;
+
+	printf("%s: %llu reads waited, %.1f%% caught spinning, "
+		"%llu served right away\n", name(),
+		(unsigned long long)waits,
+		waits ? 100.0 * num_spin / waits : 0.0,
+		(unsigned long long)num_immediate);
+	printf("%s: spin window %.2f us%s, cpu load %.1f%%\n", name(),
+		window / 1e3, tuning ? " (tuned)" : "", 100 * cpu_load());
+}
+
+serial_backend *make_serial_backend(const string &name, int fd)
+{
+	if (name == "plain")
+		return new plain_backend(fd);
+
+	if (name == "loopback")
+		return new loopback_backend(fd);
+
+	if (name == "epoll") {
+		epoll_backend *b = new epoll_backend(fd);
+
+		if (b->ok())
+			return b;
+
+		delete b;
+		return 0;
+	}
+
+	if (name == "adaptive")
+		return new adaptive_backend(fd);
+
+	/* adaptive=0 never spins, poll() only */
+	if (name.compare(0, 9, "adaptive=") == 0) {
+		const char *us = name.c_str() + 9;
+		char *end;
+		const long n = strtol(us, &end, 10);
+
+		if (end != us && !*end && n >= 0)
+			return new adaptive_backend(fd, n * 1000ULL);
+	}
+
+	if (name == "can")
+		return new can_backend(fd, 0x100);
+
+	if (name.compare(0, 4, "can=") == 0)
+		return new can_backend(fd, strtoul(name.c_str() + 4, 0, 0));
+
+	if (name == "tcp")
+		return new tcp_backend(fd);
+
+	if (name == "tcp-zerocopy")
+		return new tcp_backend(fd, false, 16384);
+
+	if (name == "rfc2217")
+		return new tcp_backend(fd, true);
+
+	if (name == "io_uring" || name == "io_uring-sqpoll") {
+		uring_backend *b = new uring_backend(fd,
+			name == "io_uring-sqpoll");
+
+		if (b->ok())
+			return b;
+
+		delete b;
+		return 0;
+	}
+
+	fprintf(stderr, "make_serial_backend(): unknown backend %s\n",
+		name.c_str());
+
+	return 0;
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
@@ -0,0 +1,463 @@
+/*
+ * serial_tcp.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "serial_io.hh"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY	60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY	0x4000000
+#endif
+
+namespace nomovok {
+namespace util {
+
+/* RFC 854 */
+enum {
+	TN_SE = 240,
+	TN_SB = 250,
+	TN_WILL = 251,
+	TN_WONT = 252,
+	TN_DO = 253,
+	TN_DONT = 254,
+	TN_IAC = 255,
+};
+
+/* RFC 856, 858, 2217 */
+enum {
+	TN_OPT_BINARY = 0,
+	TN_OPT_SGA = 3,
+	TN_OPT_COM_PORT = 44,
+};
+
+enum {
+	CPO_SET_BAUDRATE = 1,
+	CPO_SERVER_OFFSET = 100,	/* server replies, command + 100 */
+};
+
+/* parser states, past the verbs the state is the verb itself */
+enum {
+	TN_STATE_DATA = 0,
+	TN_STATE_IAC,
+	TN_STATE_SB,
+	TN_STATE_SB_IAC,
+};
+
+/* escaped tx data staged per write, source bytes */
+static const size_t tx_chunk = 4096;
+
+int tcp_connect(const string &host_port)
+{
+	struct addrinfo hints, *res, *ai;
+	size_t colon = host_port.rfind(':');
+	int fd = -1;
+	int on = 1;
+
+	if (colon == string::npos) {
+		fprintf(stderr, "tcp_connect(): %s is not host:port\n",
+			host_port.c_str());
+		return -1;
+	}
+
+	const string host = host_port.substr(0, colon);
+	const string port = host_port.substr(colon + 1);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+
+	if (err) {
+		fprintf(stderr, "tcp_connect(): %s: %s\n", host_port.c_str(),
+			gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		perror(("tcp_connect(): can't connect to " + host_port).c_str());
+		return -1;
+	}
+
+	/* a 1 byte block would otherwise wait for the previous ack */
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1 ||
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("tcp_connect(): socket setup failed");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+tcp_backend::tcp_backend(int fd, bool rfc2217, size_t zerocopy_min) :
+	fds(fd),
+	telnet(rfc2217),
+	zc_min(zerocopy_min),
+	state(TN_STATE_DATA),
+	baud(0),
+	num_commands(0),
+	answering(false),
+	answered(256),
+	tx_off(0),
+	zc_sent(0),
+	zc_done(0),
+	zc_copied(0)
+{
+	int on = 1;
+
+	if (zc_min &&
+	    setsockopt(fds, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == -1) {
+		perror("tcp_backend: no MSG_ZEROCOPY, copying");
+		zc_min = 0;
+	}
+}
+
+static ssize_t nonblocking(ssize_t n)
+{
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+
+	return n;
+}
+
+void tcp_backend::option(uint8_t verb, uint8_t opt)
+{
+	num_commands++;
+
+	if (!answering || answered[opt])
+		return;
+
+	/* what we offer ourselves, and want from the server */
+	const bool ours = opt == TN_OPT_BINARY || opt == TN_OPT_SGA ||
+		opt == TN_OPT_COM_PORT;
+	const bool theirs = opt == TN_OPT_BINARY || opt == TN_OPT_SGA;
+	uint8_t answer;
+
+	switch (verb) {
+	case TN_DO:
+		answer = ours ? TN_WILL : TN_WONT;
+		break;
+	case TN_WILL:
+		answer = theirs ? TN_DO : TN_DONT;
+		break;
+	default:
+		return;
+	}
+
+	answered[opt] = true;
+	replies.push_back(TN_IAC);
+	replies.push_back(answer);
+	replies.push_back(opt);
+}
+
+void tcp_backend::subnegotiation()
+{
+	num_commands++;
+
+	if (sb.size() >= 6 && sb[0] == TN_OPT_COM_PORT &&
+	    sb[1] == CPO_SERVER_OFFSET + CPO_SET_BAUDRATE)
+		baud = (uint32_t)sb[2] << 24 | sb[3] << 16 | sb[4] << 8 | sb[5];
+}
+
+/* strips telnet commands in place, returns the data bytes left */
+size_t tcp_backend::unescape(uint8_t *p, size_t len)
+{
+	size_t out = 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		const uint8_t c = p[i];
+
+		switch (state) {
+		case TN_STATE_DATA:
+			if (c == TN_IAC)
+				state = TN_STATE_IAC;
+			else
+				p[out++] = c;
+			break;
+		case TN_STATE_IAC:
+			if (c == TN_IAC) {
+				p[out++] = c;
+				state = TN_STATE_DATA;
+			} else if (c >= TN_WILL && c <= TN_DONT) {
+				state = c;
+			} else if (c == TN_SB) {
+				sb.clear();
+				state = TN_STATE_SB;
+			} else {
+				/* NOP, BRK, GA ... */
+				num_commands++;
+				state = TN_STATE_DATA;
+			}
+			break;
+		case TN_STATE_SB:
+			if (c == TN_IAC)
+				state = TN_STATE_SB_IAC;
+			else if (sb.size() < 64)
+				sb.push_back(c);
+			break;
+		case TN_STATE_SB_IAC:
+			if (c == TN_IAC) {
+				sb.push_back(c);
+				state = TN_STATE_SB;
+			} else {
+				if (c == TN_SE)
+					subnegotiation();
+				state = TN_STATE_DATA;
+			}
+			break;
+		default:
+			option(state, c);
+			state = TN_STATE_DATA;
+			break;
+		}
+	}
+
+	return out;
+}
+
+ssize_t tcp_backend::read(void *buf, size_t len)
+{
+	uint8_t *p = (uint8_t *)buf;
+	ssize_t n = recv(fds, p, len, MSG_DONTWAIT);
+
+	if (n == 0) {
+		/* peer gone, a tty would hang up the same way */
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (n < 0)
+		return nonblocking(n);
+
+	return telnet ? unescape(p, n) : n;
+}
+
+/*
+ * Completions come in as ranges of send() calls on the error queue,
+ * flagged if the kernel ended up copying anyway (loopback always does).
+ */
+void tcp_backend::reap_zerocopy()
+{
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err))];
+	struct msghdr msg;
+
+	while (zc_sent != zc_done) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+
+		if (recvmsg(fds, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+			return;
+
+		struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+
+		if (!c)
+			continue;
+
+		const struct sock_extended_err *e =
+			(const struct sock_extended_err *)CMSG_DATA(c);
+
+		if (e->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+			continue;
+
+		const uint64_t count = e->ee_data - e->ee_info + 1;
+
+		zc_done += count;
+		if (e->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+			zc_copied += count;
+	}
+}
+
+ssize_t tcp_backend::write(const void *buf, size_t len)
+{
+	if (zc_min)
+		reap_zerocopy();
+
+	if (!telnet) {
+		int flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+
+		if (zc_min && len >= zc_min)
+			flags |= MSG_ZEROCOPY;
+
+		ssize_t n = send(fds, buf, len, flags);
+
+		/* out of pinned memory is retried, as a full buffer */
+		if (n == -1 && errno == ENOBUFS)
+			return 0;
+		if (n > 0 && (flags & MSG_ZEROCOPY))
+			zc_sent++;
+
+		return nonblocking(n);
+	}
+
+	/* what's left of the previous block goes first */
+	if (tx_off < tx.size()) {
+		ssize_t n = nonblocking(send(fds, &tx[tx_off],
+			tx.size() - tx_off, MSG_DONTWAIT | MSG_NOSIGNAL));
+
+		if (n < 0)
+			return n;
+		tx_off += n;
+		if (tx_off < tx.size())
+			return 0;
+	}
+
+	const uint8_t *p = (const uint8_t *)buf;
+
+	if (len > tx_chunk)
+		len = tx_chunk;
+
+	tx.clear();
+	tx_off = 0;
+	for (size_t i = 0; i < len; ++i) {
+		tx.push_back(p[i]);
+		if (p[i] == TN_IAC)
+			tx.push_back(TN_IAC);
+	}
+
+	/* the block is ours now, whatever the socket takes right away */
+	ssize_t n = nonblocking(send(fds, &tx[0], tx.size(),
+		MSG_DONTWAIT | MSG_NOSIGNAL));
+
+	if (n < 0)
+		return n;
+	tx_off = n;
+
+	return len;
+}
+
+bool tcp_backend::send_all(const uint8_t *p, size_t len, int timeout_ms)
+{
+	while (len) {
+		struct pollfd pfd = { fds, POLLOUT, 0 };
+		ssize_t n = send(fds, p, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (n > 0) {
+			p += n;
+			len -= n;
+			continue;
+		}
+		if (n == -1 && errno != EAGAIN && errno != EINTR)
+			return false;
+		if (poll(&pfd, 1, timeout_ms) != 1)
+			return false;
+	}
+
+	return true;
+}
+
+bool tcp_backend::negotiate(uint32_t rate, int timeout_ms)
+{
+	std::vector<uint8_t> req = {
+		TN_IAC, TN_WILL, TN_OPT_BINARY,
+		TN_IAC, TN_DO, TN_OPT_BINARY,
+		TN_IAC, TN_WILL, TN_OPT_SGA,
+		TN_IAC, TN_DO, TN_OPT_SGA,
+		TN_IAC, TN_WILL, TN_OPT_COM_PORT,
+		TN_IAC, TN_SB, TN_OPT_COM_PORT, CPO_SET_BAUDRATE,
+	};
+
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		const uint8_t b = rate >> shift;
+
+		req.push_back(b);
+		if (b == TN_IAC)
+			req.push_back(b);
+	}
+	req.push_back(TN_IAC);
+	req.push_back(TN_SE);
+
+	/* what we ask for counts as answered already */
+	answered[TN_OPT_BINARY] = true;
+	answered[TN_OPT_SGA] = true;
+	answered[TN_OPT_COM_PORT] = true;
+	answering = true;
+	baud = 0;
+
+	if (!send_all(&req[0], req.size(), timeout_ms)) {
+		perror("tcp_backend::negotiate(): send failed");
+		answering = false;
+		return false;
+	}
+
+	const auto end = std::chrono::steady_clock::now() +
+		std::chrono::milliseconds(timeout_ms);
+	uint8_t scratch[256];
+
+	while (!baud && std::chrono::steady_clock::now() < end) {
+		struct pollfd pfd = { fds, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 10) != 1)
+			continue;
+		if (read(scratch, sizeof(scratch)) < 0)
+			break;
+
+		if (!replies.empty()) {
+			send_all(&replies[0], replies.size(), timeout_ms);
+			replies.clear();
+		}
+	}
+
+	answering = false;
+
+	if (!baud) {
+		fprintf(stderr, "tcp_backend::negotiate(): no baud rate "
+			"confirmation from the server\n");
+		return false;
+	}
+
+	if (baud != rate)
+		fprintf(stderr, "tcp_backend::negotiate(): asked for %u, "
+			"server set %u\n", rate, baud);
+
+	return true;
+}
+
+void tcp_backend::print_stats() const
+{
+	if (num_commands)
+		printf("%s: %llu telnet commands, remote baud %u\n", name(),
+			(unsigned long long)num_commands, baud);
+
+	if (zc_sent)
+		printf("%s: %llu zerocopy sends, %llu done, %llu copied "
+			"anyway\n", name(), (unsigned long long)zc_sent,
+			(unsigned long long)zc_done,
+			(unsigned long long)zc_copied);
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
@@ -0,0 +1,422 @@
+/*
+ * serial_uring.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "serial_io.hh"
+#include "realtime.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <endian.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+namespace nomovok {
+namespace util {
+
+/* two of them in flight per direction, at most */
+static const unsigned ring_entries = 8;
+
+enum {
+	UD_POLL_IN = 1,
+	UD_READ,
+	UD_POLL_OUT,
+	UD_WRITE,
+};
+
+enum {
+	BUF_RX = 0,
+	BUF_TX,
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, 0, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_backend::uring_backend(int fd, bool sqpoll, size_t buf_size) :
+	fds(fd),
+	sqpoll(sqpoll),
+	buf_size(buf_size),
+	ring_fd(-1),
+	sq_ptr(MAP_FAILED),
+	cq_ptr(MAP_FAILED),
+	sqes(0),
+	bufs(0),
+	rx_pending(false),
+	rx_have(0),
+	rx_off(0),
+	tx_pending(false),
+	tx_have(0),
+	tx_off(0),
+	error(0)
+{
+	if (!setup())
+		teardown();
+}
+
+uring_backend::~uring_backend()
+{
+	teardown();
+}
+
+bool uring_backend::setup()
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	if (sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 2000;	/* ms */
+	}
+
+	ring_fd = io_uring_setup(ring_entries, &p);
+	if (ring_fd == -1) {
+		perror("uring_backend: io_uring_setup failed");
+		return false;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		perror("uring_backend: sq ring mmap failed");
+		return false;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(0, cq_size, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_POPULATE, ring_fd,
+			      IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			perror("uring_backend: cq ring mmap failed");
+			return false;
+		}
+	}
+
+	void *s = mmap(0, sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if (s == MAP_FAILED) {
+		perror("uring_backend: sqes mmap failed");
+		return false;
+	}
+	sqes = (struct io_uring_sqe *)s;
+
+	char *sq = (char *)sq_ptr;
+	char *cq = (char *)cq_ptr;
+
+	sq_head = (unsigned *)(sq + p.sq_off.head);
+	sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	sq_array = (unsigned *)(sq + p.sq_off.array);
+	cq_head = (unsigned *)(cq + p.cq_off.head);
+	cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	/*
+	 * rx and tx buffers, pinned and registered with the ring once. The
+	 * rings are kernel pages, these are ours to lock in budget mode.
+	 */
+	bufs = (uint8_t *)rt_alloc(2 * buf_size);
+	if (!bufs)
+		return false;
+
+	struct iovec iov[2];
+
+	iov[BUF_RX].iov_base = bufs;
+	iov[BUF_RX].iov_len = buf_size;
+	iov[BUF_TX].iov_base = bufs + buf_size;
+	iov[BUF_TX].iov_len = buf_size;
+
+	if (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iov, 2) == -1) {
+		perror("uring_backend: buffer registration failed");
+		return false;
+	}
+
+	return true;
+}
+
+void uring_backend::teardown()
+{
+	if (bufs) {
+		rt_free(bufs, 2 * buf_size);
+		bufs = 0;
+	}
+	if (sqes) {
+		munmap(sqes, sqes_size);
+		sqes = 0;
+	}
+	if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	cq_ptr = MAP_FAILED;
+	if (sq_ptr != MAP_FAILED) {
+		munmap(sq_ptr, sq_size);
+		sq_ptr = MAP_FAILED;
+	}
+	if (ring_fd != -1) {
+		close(ring_fd);
+		ring_fd = -1;
+	}
+}
+
+/*
+ * False, with error set, if the kernel took none of the sqes. They are
+ * taken back then, nothing will complete for them.
+ */
+bool uring_backend::submit(unsigned count)
+{
+	__atomic_store_n(sq_tail, *sq_tail + count, __ATOMIC_RELEASE);
+
+	if (sqpoll) {
+		/* the tail store must be visible before we look at the flag */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			io_uring_enter(ring_fd, 0, IORING_ENTER_SQ_WAKEUP);
+		return true;
+	}
+
+	if (io_uring_enter(ring_fd, count, 0) == -1) {
+		/* without sqpoll only io_uring_enter() consumes sqes */
+		error = errno;
+		__atomic_store_n(sq_tail, *sq_tail - count, __ATOMIC_RELEASE);
+		return false;
+	}
+
+	return true;
+}
+
+static void prep_poll(struct io_uring_sqe *sqe, int fd, uint32_t events,
+		      uint64_t user_data)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->flags = IOSQE_IO_LINK;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	sqe->user_data = user_data;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, uint8_t opcode, int fd,
+		    void *buf, size_t len, uint16_t buf_index,
+		    uint64_t user_data)
+{
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;	/* a tty is a stream */
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->buf_index = buf_index;
+	sqe->user_data = user_data;
+}
+
+/*
+ * We are the only producer: hands out the two sqes at the current tail,
+ * published by submit() once the whole link is filled in. Returns false
+ * if the ring is full.
+ */
+static bool next_sqes(unsigned *sq_head, unsigned *sq_tail, unsigned mask,
+		      unsigned entries, unsigned *sq_array,
+		      struct io_uring_sqe *sqes,
+		      struct io_uring_sqe **a, struct io_uring_sqe **b)
+{
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *sq_tail;
+
+	if (tail - head + 2 > entries)
+		return false;
+
+	sq_array[tail & mask] = tail & mask;
+	sq_array[(tail + 1) & mask] = (tail + 1) & mask;
+	*a = &sqes[tail & mask];
+	*b = &sqes[(tail + 1) & mask];
+
+	return true;
+}
+
+void uring_backend::arm_read()
+{
+	struct io_uring_sqe *poll, *rd;
+
+	if (!next_sqes(sq_head, sq_tail, *sq_mask, *sq_entries, sq_array,
+		       sqes, &poll, &rd))
+		return;
+
+	prep_poll(poll, fds, POLLIN, UD_POLL_IN);
+	prep_rw(rd, IORING_OP_READ_FIXED, fds, bufs, buf_size, BUF_RX,
+		UD_READ);
+
+	rx_pending = submit(2);
+}
+
+void uring_backend::arm_write()
+{
+	struct io_uring_sqe *poll, *wr;
+
+	if (!next_sqes(sq_head, sq_tail, *sq_mask, *sq_entries, sq_array,
+		       sqes, &poll, &wr))
+		return;
+
+	prep_poll(poll, fds, POLLOUT, UD_POLL_OUT);
+	prep_rw(wr, IORING_OP_WRITE_FIXED, fds, bufs + buf_size + tx_off,
+		tx_have - tx_off, BUF_TX, UD_WRITE);
+
+	tx_pending = submit(2);
+}
+
+static bool transient(int res)
+{
+	return res == -EAGAIN || res == -EINTR || res == -ECANCELED;
+}
+
+void uring_backend::reap()
+{
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+
+		switch (cqe->user_data) {
+		case UD_READ:
+			rx_pending = false;
+			if (cqe->res > 0) {
+				rx_have = cqe->res;
+				rx_off = 0;
+			} else if (cqe->res < 0 && !transient(cqe->res)) {
+				error = -cqe->res;
+			}
+			break;
+		case UD_WRITE:
+			tx_pending = false;
+			if (cqe->res > 0)
+				tx_off += cqe->res;
+			else if (cqe->res < 0 && !transient(cqe->res))
+				error = -cqe->res;
+			break;
+		default:
+			/* poll results, a failure cancels the linked op */
+			break;
+		}
+	}
+
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+ssize_t uring_backend::read(void *buf, size_t len)
+{
+	reap();
+
+	if (rx_off < rx_have) {
+		size_t n = rx_have - rx_off;
+
+		if (n > len)
+			n = len;
+		memcpy(buf, bufs + rx_off, n);
+		rx_off += n;
+
+		/* buffer drained, hand it back to the kernel right away */
+		if (rx_off == rx_have)
+			arm_read();
+
+		return n;
+	}
+
+	/* a failed completion or submission */
+	if (!rx_pending)
+		arm_read();
+
+	if (error) {
+		errno = error;
+		error = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t uring_backend::write(const void *buf, size_t len)
+{
+	reap();
+
+	if (error) {
+		errno = error;
+		error = 0;
+		return -1;
+	}
+
+	if (tx_pending)
+		return 0;
+
+	/* short write, the rest of the buffer goes first */
+	if (tx_off < tx_have) {
+		arm_write();
+		len = 0;
+	} else {
+		if (len > buf_size)
+			len = buf_size;
+
+		memcpy(bufs + buf_size, buf, len);
+		tx_have = len;
+		tx_off = 0;
+		arm_write();
+	}
+
+	/* not submitted, drop what is left so it doesn't go out later */
+	if (error) {
+		tx_have = tx_off = 0;
+		errno = error;
+		error = 0;
+		return -1;
+	}
+
+	/* a full ring, the caller retries with its data */
+	if (!tx_pending && len) {
+		tx_have = 0;
+		return 0;
+	}
+
+	return len;
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
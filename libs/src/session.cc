@@ -0,0 +1,710 @@
+/*
+ * session.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "session.hh"
+#include "clock.hh"
+
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <numeric>
+#include <random>
+#include <thread>
+
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace nomovok {
+namespace util {
+
+static const uint8_t sync0 = 0xa5;
+static const uint8_t sync1 = 0x5a;
+static const uint8_t version = 1;
+/* control frames are repeated until the other end answers */
+static const int repeat_ms = 100;
+/* sync, type, length, crc */
+static const size_t frame_overhead = 6;
+/* well over the start skew of the two ends */
+static const int guard_ms = 100;
+/* a probe not answered by then is lost */
+static const int probe_timeout_ms = 200;
+/* sequence number of the probe that ends a cluster */
+static const uint8_t last_probe = 0xff;
+static const size_t values_per_frame = 30;
+
+enum {
+	MSG_HELLO = 1,
+	MSG_GO,
+	MSG_ACK,
+	MSG_STATS,
+	MSG_PROBE,
+	MSG_REPLY,
+	/* one type per frame of values, up to 255 */
+	MSG_VALUES = 16,
+};
+
+typedef chrono::steady_clock steady;
+
+/* the clock the testers stamp payloads with */
+static uint64_t now_ns()
+{
+	return monotonic_clock::now().time_since_epoch().count();
+}
+
+static int ms_left(const steady::time_point &end)
+{
+	auto left = chrono::duration_cast<chrono::milliseconds>(
+		end - steady::now()).count();
+
+	return left > 0 ? left : 0;
+}
+
+/* CRC-16/CCITT-FALSE */
+static uint16_t crc16(const uint8_t *p, size_t len)
+{
+	uint16_t crc = 0xffff;
+
+	while (len--) {
+		crc ^= (uint16_t)*p++ << 8;
+		for (int i = 0; i < 8; ++i)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+
+	return crc;
+}
+
+static void put(vector<uint8_t> *v, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		v->push_back(value >> (8 * i));
+}
+
+static uint64_t get(const vector<uint8_t> &v, size_t *off, int bytes)
+{
+	uint64_t value = 0;
+
+	for (int i = 0; i < bytes; ++i)
+		value |= (uint64_t)v[(*off)++] << (8 * i);
+
+	return value;
+}
+
+session::session(int fd, const session_config &config) :
+	fds(fd),
+	cfg(config),
+	nonce(0),
+	is_leader(false),
+	peer_stats(),
+	estimate(),
+	first(),
+	has_pending(false),
+	pending_type(0),
+	rx_in_frame(false),
+	rx_prev(0)
+{
+	random_device rd;
+
+	/* 0 is kept for "not set" */
+	while (!nonce)
+		nonce = rd();
+}
+
+bool session::send(uint8_t type, const vector<uint8_t> &payload)
+{
+	vector<uint8_t> frame = { sync0, sync1, type, (uint8_t)payload.size() };
+
+	frame.insert(frame.end(), payload.begin(), payload.end());
+
+	const uint16_t crc = crc16(&frame[2], frame.size() - 2);
+
+	frame.push_back(crc >> 8);
+	frame.push_back(crc);
+
+	const uint8_t *p = &frame[0];
+	size_t len = frame.size();
+
+	while (len) {
+		ssize_t n = write(fds, p, len);
+
+		if (n > 0) {
+			p += n;
+			len -= n;
+			continue;
+		}
+		if (n == -1 && errno != EAGAIN && errno != EINTR) {
+			perror("session: write failed");
+			return false;
+		}
+
+		struct pollfd pfd = { fds, POLLOUT, 0 };
+
+		if (poll(&pfd, 1, repeat_ms) == -1 && errno != EINTR)
+			return false;
+	}
+
+	return true;
+}
+
+bool session::read_byte(uint8_t *c, int timeout_ms)
+{
+	for (;;) {
+		ssize_t n = read(fds, c, 1);
+
+		if (n == 1)
+			return true;
+		if (n == -1 && errno != EAGAIN && errno != EINTR)
+			return false;
+
+		struct pollfd pfd = { fds, POLLIN, 0 };
+
+		if (poll(&pfd, 1, timeout_ms) != 1)
+			return false;
+	}
+}
+
+int session::wire_ms(size_t len) const
+{
+	if (!cfg.baud)
+		return 0;
+
+	/* 10 bits a byte, start and stop included */
+	return (len + frame_overhead) * 10 * 1000 / cfg.baud + 1;
+}
+
+/* a repeat must not go out before the last one is on the other end */
+int session::repeat_every(size_t len) const
+{
+	return max(repeat_ms, 2 * wire_ms(len));
+}
+
+void session::new_phase()
+{
+	rx_in_frame = false;
+	rx_prev = 0;
+	rx_frame.clear();
+}
+
+/* a frame for the next phase, it gets it from receive() first */
+void session::push_back(uint8_t type, vector<uint8_t> *payload)
+{
+	has_pending = true;
+	pending_type = type;
+	pending_payload.swap(*payload);
+}
+
+/*
+ * Next valid frame within timeout_ms, skipping anything else. What came
+ * in of a frame by then is kept for the next call. Nothing is read past
+ * the timeout, even if more is already there.
+ */
+bool session::receive(uint8_t *type, vector<uint8_t> *payload,
+		      int timeout_ms)
+{
+	const auto end = steady::now() + chrono::milliseconds(timeout_ms);
+	uint8_t c;
+
+	if (has_pending) {
+		has_pending = false;
+		*type = pending_type;
+		payload->swap(pending_payload);
+		return true;
+	}
+
+	for (;;) {
+		if (steady::now() >= end || !read_byte(&c, ms_left(end)))
+			return false;
+
+		if (!rx_in_frame) {
+			rx_in_frame = rx_prev == sync0 && c == sync1;
+			rx_prev = rx_in_frame ? 0 : c;
+			rx_frame.clear();
+			continue;
+		}
+
+		/* type, length, payload, crc */
+		rx_frame.push_back(c);
+		if (rx_frame.size() < 2 ||
+		    rx_frame.size() < rx_frame[1] + 4u)
+			continue;
+
+		const size_t len = rx_frame.size() - 2;
+
+		rx_in_frame = false;
+		if (crc16(&rx_frame[0], len) !=
+		    (rx_frame[len] << 8 | rx_frame[len + 1]))
+			continue;
+
+		*type = rx_frame[0];
+		payload->assign(rx_frame.begin() + 2, rx_frame.begin() + len);
+
+		return true;
+	}
+}
+
+/*
+ * Sends mine every repeat period, with a flag: 0 as long as the other
+ * end's hasn't come, 1 once it has, 2 once the other end's has come with
+ * 1 set too, i.e. both ends have both. The first to get a 1 answers with
+ * a 2 and lingers, the other end may have missed it. Without speak,
+ * nothing goes out before the other end's is in.
+ */
+bool session::agree(uint8_t type, const vector<uint8_t> &mine,
+		    vector<uint8_t> *theirs, int timeout_ms, bool speak)
+{
+	const int every = repeat_every(mine.size() + 1);
+	const auto end = steady::now() + chrono::milliseconds(timeout_ms);
+	auto next = steady::now();
+	vector<uint8_t> out = mine, in;
+	bool seen = false;
+	uint8_t t;
+
+	out.push_back(0);
+
+	while (steady::now() < end) {
+		if ((speak || seen) && steady::now() >= next) {
+			out.back() = seen;
+			if (!send(type, out))
+				return false;
+			next = steady::now() + chrono::milliseconds(every);
+		}
+
+		if (!receive(&t, &in, ms_left((speak || seen) ?
+					      min(next, end) : end)))
+			continue;
+		if (t != type || in.size() != out.size())
+			continue;
+
+		theirs->assign(in.begin(), in.end() - 1);
+
+		/* the other end has both and is done */
+		if (in.back() == 2)
+			return true;
+
+		if (in.back() == 1) {
+			out.back() = 2;
+			return linger(type, type, out, every);
+		}
+
+		/* first time we hear of it, tell right away */
+		if (!seen) {
+			seen = true;
+			next = steady::now();
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Sends answer, then again for every frame of type the other end still
+ * repeats, until it has been quiet for longer than its repeat period.
+ * A frame of the next phase ends it early, kept for that phase.
+ */
+bool session::linger(uint8_t type, uint8_t answer_type,
+		     const vector<uint8_t> &answer, int every)
+{
+	vector<uint8_t> in;
+	uint8_t t;
+
+	if (!send(answer_type, answer))
+		return false;
+
+	while (receive(&t, &in, every + every / 2)) {
+		if (t != type) {
+			push_back(t, &in);
+			break;
+		}
+
+		/* an agree() 2 is its own answer to ours, that needs none */
+		if (in.size() != answer.size() ||
+		    (!in.empty() && in.back() == 2))
+			continue;
+		if (!send(answer_type, answer))
+			return false;
+	}
+
+	return true;
+}
+
+bool session::start(int timeout_ms)
+{
+	vector<uint8_t> hello, theirs;
+	size_t off = 0;
+
+	new_phase();
+	put(&hello, version, 1);
+	put(&hello, cfg.baud, 4);
+	put(&hello, cfg.payload_bits, 4);
+	put(&hello, cfg.duration_ms, 4);
+	put(&hello, nonce, 4);
+
+	if (!agree(MSG_HELLO, hello, &theirs, timeout_ms)) {
+		fprintf(stderr, "session: no answer from the other end\n");
+		return false;
+	}
+
+	const uint32_t v = get(theirs, &off, 1);
+	const uint32_t baud = get(theirs, &off, 4);
+	const uint32_t bits = get(theirs, &off, 4);
+	const uint32_t duration = get(theirs, &off, 4);
+	const uint32_t peer_nonce = get(theirs, &off, 4);
+
+	if (v != version || baud != cfg.baud || bits != cfg.payload_bits ||
+	    duration != cfg.duration_ms) {
+		fprintf(stderr, "session: config mismatch, here/there: "
+			"version %u/%u, baud %u/%u, payload bits %u/%u, "
+			"duration %u/%u ms\n", version, v, cfg.baud, baud,
+			cfg.payload_bits, bits, cfg.duration_ms, duration);
+		return false;
+	}
+
+	if (peer_nonce == nonce) {
+		fprintf(stderr, "session: both ends drew the same nonce, "
+			"restart\n");
+		return false;
+	}
+
+	is_leader = nonce > peer_nonce;
+
+	const auto end = steady::now() + chrono::milliseconds(timeout_ms);
+	vector<uint8_t> in;
+	uint8_t t;
+
+	const int every = repeat_every(0);
+
+	/*
+	 * The follower answers every GO until they stop, then starts, so the
+	 * leader waits out the same quiet time after the ACK, reading away
+	 * the ACKs of GOs that were already out. Late hellos of the other end
+	 * are skipped meanwhile.
+	 */
+	if (is_leader) {
+		while (steady::now() < end) {
+			const auto next = steady::now() +
+				chrono::milliseconds(every);
+
+			if (!send(MSG_GO, vector<uint8_t>()))
+				return false;
+
+			while (receive(&t, &in, ms_left(min(next, end)))) {
+				if (t != MSG_ACK)
+					continue;
+
+				const auto quiet = steady::now() +
+					chrono::milliseconds(every + every / 2);
+
+				while (steady::now() < quiet)
+					receive(&t, &in, ms_left(quiet));
+				new_phase();
+				return true;
+			}
+		}
+	} else {
+		while (receive(&t, &in, ms_left(end))) {
+			if (t != MSG_GO)
+				continue;
+			if (!linger(MSG_GO, MSG_ACK, vector<uint8_t>(), every))
+				return false;
+
+			/* start once the ack is out, not just queued */
+			tcdrain(fds);
+			return true;
+		}
+	}
+
+	fprintf(stderr, "session: start barrier timed out\n");
+	return false;
+}
+
+void session::add_cluster(const vector<int64_t> &offsets,
+			  const vector<uint64_t> &delays,
+			  const vector<uint64_t> &refs)
+{
+	vector<size_t> order(offsets.size());
+
+	iota(order.begin(), order.end(), 0);
+	sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return delays[a] < delays[b];
+	});
+
+	const size_t best = order[0];
+	const size_t half = (order.size() + 1) / 2;
+	double mean = 0, var = 0;
+
+	for (size_t i = 0; i < half; ++i)
+		mean += offsets[order[i]];
+	mean /= half;
+	for (size_t i = 0; i < half; ++i)
+		var += (offsets[order[i]] - mean) * (offsets[order[i]] - mean);
+
+	clock_estimate e;
+
+	e.offset_ns = offsets[best];
+	e.ref_ns = refs[best];
+	e.bound_ns = delays[best] / 2;
+	e.jitter_ns = sqrt(var / half);
+	e.drift = 0;
+	e.drift_bound = 0;
+	e.clusters = estimate.clusters + 1;
+
+	if (e.clusters == 1) {
+		first = e;
+	} else {
+		const double span = (int64_t)(e.ref_ns - first.ref_ns);
+
+		if (span > 0) {
+			e.drift = (e.offset_ns - first.offset_ns) / span;
+			e.drift_bound = (e.bound_ns + first.bound_ns) / span;
+		}
+	}
+
+	estimate = e;
+}
+
+/*
+ * Probe i carries its send time t1 and the arrival time t4 of the answer
+ * to probe i - 1, the answer the arrival t2 and send time t3 of probe i,
+ * so both ends have all four for every probe that made it both ways.
+ * Probes and answers are the same length, the time on the wire cancels
+ * out of the offset.
+ */
+bool session::probe_clock(int count, int timeout_ms)
+{
+	vector<int64_t> offsets;
+	vector<uint64_t> delays, refs;
+	vector<uint8_t> out, in;
+	uint8_t t;
+
+	/* peer - local with the leader local, and the round trip */
+	auto record = [&](uint64_t t1, uint64_t t2, uint64_t t3, uint64_t t4) {
+		const int64_t offset =
+			((int64_t)(t2 - t1) + (int64_t)(t3 - t4)) / 2;
+		const int64_t delay = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+
+		offsets.push_back(is_leader ? offset : -offset);
+		delays.push_back(delay > 0 ? delay : 0);
+		refs.push_back(is_leader ? t1 + (t4 - t1) / 2 :
+			t2 + (t3 - t2) / 2);
+	};
+
+	if (count > last_probe - 1)
+		count = last_probe - 1;
+
+	new_phase();
+
+	if (is_leader) {
+		uint64_t prev_t4 = 0;
+
+		/* the follower's receiver may still run, as for the stats */
+		this_thread::sleep_for(chrono::milliseconds(guard_ms));
+
+		for (int i = 0; i <= count; ++i) {
+			const uint8_t seq = i < count ? i : last_probe;
+			const uint64_t t1 = now_ns();
+
+			out.clear();
+			put(&out, seq, 1);
+			put(&out, t1, 8);
+			put(&out, prev_t4, 8);
+
+			if (!send(MSG_PROBE, out))
+				return false;
+			if (seq == last_probe)
+				break;
+
+			const auto end = steady::now() +
+				chrono::milliseconds(probe_timeout_ms);
+
+			prev_t4 = 0;
+
+			while (receive(&t, &in, ms_left(end))) {
+				const uint64_t t4 = now_ns();
+				size_t off = 1;
+
+				if (t != MSG_REPLY || in.size() != 17 ||
+				    in[0] != seq)
+					continue;
+
+				const uint64_t t2 = get(in, &off, 8);
+				const uint64_t t3 = get(in, &off, 8);
+
+				record(t1, t2, t3, t4);
+				prev_t4 = t4;
+				break;
+			}
+		}
+	} else {
+		uint64_t t1 = 0, t2 = 0, t3 = 0;
+		bool answered = false;
+		int wait = timeout_ms;
+
+		while (receive(&t, &in, wait)) {
+			const uint64_t now = now_ns();
+			size_t off = 0;
+
+			/* the leader went on without our last answer */
+			if (t != MSG_PROBE) {
+				push_back(t, &in);
+				break;
+			}
+			if (in.size() != 17)
+				continue;
+
+			const uint8_t seq = get(in, &off, 1);
+			const uint64_t probe_t1 = get(in, &off, 8);
+			const uint64_t prev_t4 = get(in, &off, 8);
+
+			/* only set if our last answer made it */
+			if (prev_t4 && answered)
+				record(t1, t2, t3, prev_t4);
+			answered = false;
+
+			if (seq == last_probe)
+				break;
+
+			t1 = probe_t1;
+			t2 = now;
+			out.clear();
+			put(&out, seq, 1);
+			put(&out, t2, 8);
+			t3 = now_ns();
+			put(&out, t3, 8);
+
+			if (!send(MSG_REPLY, out))
+				return false;
+			answered = true;
+			wait = 5 * probe_timeout_ms;
+		}
+	}
+
+	/* both go on once the last probe is through */
+	tcdrain(fds);
+
+	if (offsets.empty()) {
+		fprintf(stderr, "session: no clock probe made it both ways\n");
+		return false;
+	}
+
+	add_cluster(offsets, delays, refs);
+
+	return true;
+}
+
+bool session::exchange(const session_stats &local, int timeout_ms)
+{
+	vector<uint8_t> mine, theirs;
+	size_t off = 0;
+
+	new_phase();
+	put(&mine, local.tx_packets, 8);
+	put(&mine, local.rx_packets, 8);
+	put(&mine, local.rx_errors, 8);
+	put(&mine, local.rx_missed, 8);
+	put(&mine, local.tx_ns, 8);
+	put(&mine, local.rx_ns, 8);
+
+	/*
+	 * The follower's receiver may still run for the start skew, it only
+	 * answers, and the leader gives it a guard time before speaking.
+	 */
+	if (is_leader)
+		this_thread::sleep_for(chrono::milliseconds(guard_ms));
+
+	if (!agree(MSG_STATS, mine, &theirs, timeout_ms, is_leader)) {
+		fprintf(stderr, "session: no stats from the other end\n");
+		return false;
+	}
+
+	peer_stats.tx_packets = get(theirs, &off, 8);
+	peer_stats.rx_packets = get(theirs, &off, 8);
+	peer_stats.rx_errors = get(theirs, &off, 8);
+	peer_stats.rx_missed = get(theirs, &off, 8);
+	peer_stats.tx_ns = get(theirs, &off, 8);
+	peer_stats.rx_ns = get(theirs, &off, 8);
+
+	return true;
+}
+
+bool session::exchange_values(const vector<uint64_t> &mine,
+			      vector<uint64_t> *theirs, int timeout_ms)
+{
+	vector<uint8_t> out, in;
+
+	if (mine.size() > values_per_frame * (256 - MSG_VALUES)) {
+		fprintf(stderr, "session: too many values to exchange\n");
+		return false;
+	}
+
+	theirs->clear();
+	new_phase();
+
+	for (size_t i = 0, frame = 0; i < mine.size();
+	     i += values_per_frame, ++frame) {
+		const size_t n = min(values_per_frame, mine.size() - i);
+		size_t off = 0;
+
+		out.clear();
+		for (size_t j = 0; j < n; ++j)
+			put(&out, mine[i + j], 8);
+
+		if (!agree(MSG_VALUES + frame, out, &in, timeout_ms)) {
+			fprintf(stderr, "session: no values from the other "
+				"end\n");
+			return false;
+		}
+
+		for (size_t j = 0; j < n; ++j)
+			theirs->push_back(get(in, &off, 8));
+	}
+
+	return true;
+}
+
+void session::print_clock() const
+{
+	printf("==== clock ====\n");
+	printf("Peer clock offset = %+.3f us, bound %.3f us, "
+		"jitter %.3f us\n", estimate.offset_ns / 1e3,
+		estimate.bound_ns / 1e3, estimate.jitter_ns / 1e3);
+	if (estimate.clusters > 1)
+		printf("Peer clock drift = %+.3f ppm, bound %.3f ppm\n",
+			estimate.drift * 1e6, estimate.drift_bound * 1e6);
+}
+
+static void print_direction(const char *title, const session_stats &from,
+			    const session_stats &to)
+{
+	const uint64_t lost = from.tx_packets > to.rx_packets ?
+		from.tx_packets - to.rx_packets : 0;
+	const double seconds = from.tx_ns / 1e9;
+
+	printf("==== %s ====\n", title);
+	printf("Sent packets = %" PRIu64 "\n", from.tx_packets);
+	printf("Received packets = %" PRIu64 "\n", to.rx_packets);
+	printf("Lost packets = %" PRIu64 "\n", lost);
+	printf("Num errors = %" PRIu64 "\n", to.rx_errors);
+	printf("Num missed = %" PRIu64 "\n", to.rx_missed);
+	printf("Avg packets/s = %.2f\n",
+		seconds > 0 ? to.rx_packets / seconds : 0.0);
+}
+
+void session::print(const session_stats &local, const session_stats &peer)
+{
+	print_direction("here -> there", local, peer);
+	print_direction("there -> here", peer, local);
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
@@ -0,0 +1,186 @@
+/*
+ * shmstats.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "shmstats.hh"
+#include "clock.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+namespace nomovok {
+namespace util {
+
+/* a publisher copies a slot in well under a ms */
+static const int read_retries = 10000;
+
+shm_stats::shm_stats() : seg(0), owner(false)
+{
+}
+
+shm_stats::~shm_stats()
+{
+	if (!seg)
+		return;
+
+	munmap(seg, sizeof(shm_segment));
+	if (owner)
+		shm_unlink(path.c_str());
+}
+
+bool shm_stats::create(const std::string &name, const std::string &tool)
+{
+	path = name[0] == '/' ? name : "/" + name;
+
+	/* a left over of a crashed run goes */
+	shm_unlink(path.c_str());
+
+	int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd == -1) {
+		perror(("shm_stats: can't create " + path).c_str());
+		return false;
+	}
+
+	if (ftruncate(fd, sizeof(shm_segment)) == -1) {
+		perror("shm_stats: ftruncate failed");
+		close(fd);
+		shm_unlink(path.c_str());
+		return false;
+	}
+
+	void *p = mmap(0, sizeof(shm_segment), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		perror("shm_stats: mmap failed");
+		shm_unlink(path.c_str());
+		return false;
+	}
+
+	/* fresh pages are zero, all but the atomics is plain data */
+	seg = new (p) shm_segment;
+	seg->num_ports.store(0);
+	for (auto &s : seg->slots)
+		s.seq.store(0);
+
+	seg->size = sizeof(shm_segment);
+	seg->pid = getpid();
+	seg->start_ns = monotonic_clock::now().time_since_epoch().count();
+	strncpy(seg->tool, tool.c_str(), sizeof(seg->tool) - 1);
+	seg->version = shm_stats_version;
+	/* readers check the magic first, it goes in last */
+	std::atomic_thread_fence(std::memory_order_release);
+	seg->magic = shm_stats_magic;
+
+	owner = true;
+
+	return true;
+}
+
+bool shm_stats::attach(const std::string &name)
+{
+	path = name[0] == '/' ? name : "/" + name;
+
+	int fd = shm_open(path.c_str(), O_RDONLY, 0);
+
+	if (fd == -1) {
+		perror(("shm_stats: can't open " + path).c_str());
+		return false;
+	}
+
+	void *p = mmap(0, sizeof(shm_segment), PROT_READ, MAP_SHARED, fd, 0);
+
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		perror("shm_stats: mmap failed");
+		return false;
+	}
+
+	shm_segment *s = (shm_segment *)p;
+
+	if (s->magic != shm_stats_magic || s->version != shm_stats_version ||
+	    s->size != sizeof(shm_segment)) {
+		fprintf(stderr, "shm_stats: %s is no stats segment of this "
+			"version\n", path.c_str());
+		munmap(p, sizeof(shm_segment));
+		return false;
+	}
+
+	seg = s;
+
+	return true;
+}
+
+int shm_stats::add_port(const std::string &name)
+{
+	const int port = seg->num_ports.load(std::memory_order_relaxed);
+
+	if (port == shm_stats_ports)
+		return -1;
+
+	shm_port data = shm_port();
+
+	strncpy(data.name, name.c_str(), sizeof(data.name) - 1);
+	strcpy(data.state, "new");
+
+	publish(port, data);
+	seg->num_ports.store(port + 1, std::memory_order_release);
+
+	return port;
+}
+
+void shm_stats::publish(int port, const shm_port &data)
+{
+	shm_segment::slot &s = seg->slots[port];
+	const uint32_t seq = s.seq.load(std::memory_order_relaxed);
+
+	s.seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(&s.data, &data, sizeof(data));
+	s.seq.store(seq + 2, std::memory_order_release);
+}
+
+bool shm_stats::read(int port, shm_port *data) const
+{
+	const shm_segment::slot &s = seg->slots[port];
+
+	for (int i = 0; i < read_retries; ++i) {
+		const uint32_t seq = s.seq.load(std::memory_order_acquire);
+
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		memcpy(data, &s.data, sizeof(*data));
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (s.seq.load(std::memory_order_relaxed) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+int shm_stats::num_ports() const
+{
+	return seg ? seg->num_ports.load(std::memory_order_acquire) : 0;
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
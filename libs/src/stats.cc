@@ -0,0 +1,85 @@
+/*
+ * stats.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "stats.hh"
+
+#include <cstdio>
+#include <cstring>
+
+namespace nomovok {
+namespace util {
+
+void histogram::reset()
+{
+	memset(buckets, 0, sizeof(buckets));
+	samples = 0;
+	sum = 0;
+	lo = UINT64_MAX;
+	hi = 0;
+}
+
+void histogram::merge(const histogram &other)
+{
+	for (int i = 0; i < num_buckets; ++i)
+		buckets[i] += other.buckets[i];
+
+	samples += other.samples;
+	sum += other.sum;
+	if (other.lo < lo) lo = other.lo;
+	if (other.hi > hi) hi = other.hi;
+}
+
+uint64_t histogram::value(int index)
+{
+	if (index < sub_count)
+		return index;
+
+	int e = (index - sub_count) / sub_count + sub_bits;
+	uint64_t sub = (index - sub_count) % sub_count + sub_count;
+	uint64_t width = 1ULL << (e - sub_bits);
+
+	return (sub << (e - sub_bits)) + width / 2;
+}
+
+uint64_t histogram::percentile(double p) const
+{
+	if (!samples)
+		return 0;
+
+	uint64_t rank = (uint64_t)(p / 100.0 * samples + 0.5);
+	uint64_t seen = 0;
+
+	if (rank < 1) rank = 1;
+	if (rank > samples) rank = samples;
+
+	for (int i = 0; i < num_buckets; ++i) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			uint64_t v = value(i);
+			/* the extremes are known exactly */
+			if (v < lo) v = lo;
+			if (v > hi) v = hi;
+			return v;
+		}
+	}
+
+	return hi;
+}
+
+void histogram::print(const char *title) const
+{
+	printf("%s [us]: n %llu min %.2f p50 %.2f p90 %.2f p99 %.2f "
+		"p99.9 %.2f max %.2f\n", title, (unsigned long long)samples,
+		min() / 1000.0, percentile(50) / 1000.0,
+		percentile(90) / 1000.0, percentile(99) / 1000.0,
+		percentile(99.9) / 1000.0, max() / 1000.0);
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
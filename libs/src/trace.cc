@@ -0,0 +1,197 @@
+/*
+ * trace.cc
+ *
+ * C++ 11 utility library (libnutil)
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include "trace.hh"
+
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/serial.h>
+
+namespace nomovok {
+namespace util {
+
+trace_ring::~trace_ring()
+{
+	close();
+}
+
+bool trace_ring::open(const string &path, size_t records)
+{
+	uint64_t capacity = 1;
+
+	close();
+
+	while (capacity < records)
+		capacity <<= 1;
+
+	map_size = trace_header_size + capacity * sizeof(trace_record);
+
+	fds = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fds == -1) {
+		perror("trace_ring::open(): can't create trace file");
+		return false;
+	}
+
+	/*
+	 * allocate the blocks now, a sparse file could get SIGBUS on
+	 * a full disk while recording
+	 */
+	if (posix_fallocate(fds, 0, map_size) != 0 &&
+	    ftruncate(fds, map_size) == -1) {
+		perror("trace_ring::open(): can't size trace file");
+		close();
+		return false;
+	}
+
+	void *p = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fds, 0);
+	if (p == MAP_FAILED) {
+		perror("trace_ring::open(): mmap failed");
+		close();
+		return false;
+	}
+
+	/* fault the whole ring in now, not from the hot path */
+	memset(p, 0, map_size);
+
+	hdr = new (p) trace_header;
+	recs = (trace_record *)((char *)p + trace_header_size);
+	mask = capacity - 1;
+
+	memcpy(hdr->magic, trace_magic, sizeof(hdr->magic));
+	hdr->version = trace_version;
+	hdr->record_size = sizeof(trace_record);
+	hdr->capacity = capacity;
+	hdr->clock_base_ns = monotonic_clock::now().time_since_epoch().count();
+	hdr->head.store(0);
+	hdr->frozen.store(0);
+
+	return true;
+}
+
+bool trace_ring::attach(const string &path)
+{
+	struct stat st;
+
+	close();
+
+	fds = ::open(path.c_str(), O_RDONLY);
+	if (fds == -1 || fstat(fds, &st) == -1) {
+		perror("trace_ring::attach(): can't open trace file");
+		close();
+		return false;
+	}
+
+	if ((size_t)st.st_size < trace_header_size) {
+		fprintf(stderr, "trace_ring::attach(): %s: file too short\n",
+			path.c_str());
+		close();
+		return false;
+	}
+
+	map_size = st.st_size;
+
+	void *p = mmap(0, map_size, PROT_READ, MAP_SHARED, fds, 0);
+	if (p == MAP_FAILED) {
+		perror("trace_ring::attach(): mmap failed");
+		close();
+		return false;
+	}
+
+	trace_header *h = (trace_header *)p;
+
+	if (memcmp(h->magic, trace_magic, sizeof(h->magic)) ||
+	    h->version != trace_version ||
+	    h->record_size != sizeof(trace_record) ||
+	    h->capacity == 0 || (h->capacity & (h->capacity - 1)) ||
+	    trace_header_size + h->capacity * sizeof(trace_record) > map_size) {
+		fprintf(stderr, "trace_ring::attach(): %s: not a valid trace\n",
+			path.c_str());
+		munmap(p, map_size);
+		close();
+		return false;
+	}
+
+	hdr = h;
+	recs = (trace_record *)((char *)p + trace_header_size);
+	mask = h->capacity - 1;
+
+	return true;
+}
+
+void trace_ring::close()
+{
+	if (hdr) {
+		munmap(hdr, map_size);
+		hdr = 0;
+		recs = 0;
+	}
+	if (fds != -1) {
+		::close(fds);
+		fds = -1;
+	}
+}
+
+void trace_ring::record_block(trace_dir dir, const void *buf, size_t len)
+{
+	uint32_t first = 0;
+
+	memcpy(&first, buf, len < sizeof(first) ? len : sizeof(first));
+
+	record(dir, TRACE_BLOCK, first, 0, len > 0xffff ? 0xffff : len);
+}
+
+void trace_ring::record_counters(int fd)
+{
+	struct serial_icounter_struct ic;
+
+	/* no syscall for records that would be dropped */
+	if (!hdr || frozen() || ioctl(fd, TIOCGICOUNT, &ic) == -1)
+		return;
+
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_RX, ic.rx);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_TX, ic.tx);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_FRAME, ic.frame);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_OVERRUN, ic.overrun);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_PARITY, ic.parity);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_BRK, ic.brk);
+	record(TRACE_NONE, TRACE_COUNTER, TRACE_CNT_BUF_OVERRUN,
+	       ic.buf_overrun);
+}
+
+bool trace_ring::freeze(uint32_t reason)
+{
+	uint32_t running = 0;
+
+	if (!hdr)
+		return false;
+
+	if (!hdr->frozen.compare_exchange_strong(running, reason ? reason : 1))
+		return false;
+
+	/* the winner's only, past the frozen check of record() */
+	append(TRACE_NONE, TRACE_FREEZE, reason, 0, 0);
+
+	hdr->freeze_head = hdr->head.load();
+	hdr->freeze_ns = monotonic_clock::now().time_since_epoch().count();
+
+	/* not needed for a crash, but gets it on disk before a power loss */
+	msync(hdr, map_size, MS_ASYNC);
+
+	return true;
+}
+
+} /* end of ns util */
+} /* end of ns nomovok */
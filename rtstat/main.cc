@@ -0,0 +1,167 @@
+/*
+ * rtstat - live view of a tool's counters
+ *
+ * Attaches read-only to the shared memory stats segment a tool publishes
+ * (stt --stats_shm, rtt -s) and shows its ports top-style, or dumps one
+ * snapshot. Only reads, the tool never waits on it.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "clock.hh"
+#include "shmstats.hh"
+
+using namespace nomovok;
+using namespace std;
+
+static volatile sig_atomic_t stop;
+
+static void signal_handler(int)
+{
+	stop = 1;
+}
+
+static uint64_t now_ns()
+{
+	return util::monotonic_clock::now().time_since_epoch().count();
+}
+
+static bool publisher_alive(const util::shm_segment *seg)
+{
+	return kill(seg->pid, 0) == 0 || errno == EPERM;
+}
+
+static void dump(const util::shm_stats &stats)
+{
+	const util::shm_segment *seg = stats.segment();
+	util::shm_port p;
+
+	printf("tool=%s pid=%d alive=%d\n", seg->tool, seg->pid,
+		publisher_alive(seg));
+
+	for (int i = 0; i < stats.num_ports(); ++i) {
+		if (!stats.read(i, &p)) {
+			printf("port=%d torn\n", i);
+			continue;
+		}
+
+		printf("port=%d name=%s state=%s tx=%" PRIu64 " rx=%" PRIu64
+			" errors=%" PRIu64 " missed=%" PRIu64
+			" age_ms=%" PRIu64 "\n", i, p.name, p.state,
+			p.tx_packets, p.rx_packets, p.rx_errors, p.rx_missed,
+			(now_ns() - p.updated_ns) / 1000000);
+		if (p.latency.count())
+			p.latency.print(p.name);
+	}
+}
+
+static void top(const util::shm_stats &stats, int interval_ms)
+{
+	const util::shm_segment *seg = stats.segment();
+	vector<util::shm_port> last(util::shm_stats_ports);
+	vector<uint64_t> last_ns(util::shm_stats_ports);
+	util::shm_port p;
+
+	while (!stop) {
+		const uint64_t now = now_ns();
+
+		/* home and clear, as top does */
+		printf("\033[H\033[2J");
+		printf("%s, pid %d%s, up %.1f s\n\n", seg->tool, seg->pid,
+			publisher_alive(seg) ? "" : " (gone)",
+			(now - seg->start_ns) / 1e9);
+		printf("%-20s %-8s %12s %10s %12s %10s %8s %8s "
+			"%9s %9s %9s\n", "port", "state", "tx", "tx/s",
+			"rx", "rx/s", "errors", "missed",
+			"p50 us", "p99 us", "max us");
+
+		for (int i = 0; i < stats.num_ports(); ++i) {
+			if (!stats.read(i, &p))
+				continue;
+
+			const double dt = last_ns[i] ?
+				(p.updated_ns - last_ns[i]) / 1e9 : 0;
+			const double tx_rate = dt > 0 ?
+				(p.tx_packets - last[i].tx_packets) / dt : 0;
+			const double rx_rate = dt > 0 ?
+				(p.rx_packets - last[i].rx_packets) / dt : 0;
+
+			printf("%-20s %-8s %12" PRIu64 " %10.0f %12" PRIu64
+				" %10.0f %8" PRIu64 " %8" PRIu64
+				" %9.1f %9.1f %9.1f\n", p.name, p.state,
+				p.tx_packets, tx_rate, p.rx_packets, rx_rate,
+				p.rx_errors, p.rx_missed,
+				p.latency.percentile(50) / 1e3,
+				p.latency.percentile(99) / 1e3,
+				p.latency.max() / 1e3);
+
+			if (p.updated_ns != last_ns[i]) {
+				last[i] = p;
+				last_ns[i] = p.updated_ns;
+			}
+		}
+
+		fflush(stdout);
+		usleep(interval_ms * 1000);
+	}
+}
+
+void usage()
+{
+	printf("usage: rtstat [-d] [-i ms] name\n\n"
+		"  -d     dump one snapshot and exit\n"
+		"  -i ms  refresh interval, default 1000\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	util::shm_stats stats;
+	bool once = false;
+	int interval_ms = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "di:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			once = true;
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (optind >= argc || interval_ms <= 0) {
+		usage();
+		exit(0);
+	}
+
+	if (!stats.attach(argv[optind]))
+		return 1;
+
+	if (once) {
+		dump(stats);
+		return 0;
+	}
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	top(stats, interval_ms);
+
+	return 0;
+}
@@ -22,32 +22,175 @@
 #include <atomic>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
 #include <unistd.h>
 #include <pthread.h>
 #include <limits.h>
+#include <sys/resource.h>
 #include <sys/utsname.h>
 
 #include "serial.hh"
 #include "realtime.hh"
 #include "general.hh"
+#include "irq.hh"
+#include "load.hh"
+#include "cacheline.hh"
 #include "clock.hh"
 #include "log.hh"
+#include "serial_io.hh"
+#include "shmstats.hh"
+#include "stats.hh"
+#include "trace.hh"
 
 static const int thread_stack_size = (100*1024);
+static const size_t trace_records = (64*1024);
+/* ms between two publishes of the live stats */
+static const long publish_period_ms = 100;
+/* torn copies of the RX counters before a publish is skipped */
+static const int publish_retries = 100;
 
 using namespace nomovok;
 using namespace std;
 
 namespace peloton {
 
-static bool exit_requested = false;
+static util::stop_token exit_requested;
+/* flight recorder, frozen on the first rx error */
+static util::trace_ring trace;
+/* serial_io backend, each thread builds its own */
+static string backend = "plain";
+/* cpu for the tester threads, -1 leaves them to the scheduler */
+static int tester_cpu = -1;
+/* time between received bytes, what the irq placement shows up in */
+static util::histogram rx_gaps;
+/* background load, off the tester cpu */
+static util::load_generator load;
+/* live stats for rtstat, a slot per thread, -1 when not published */
+static util::shm_stats shm;
+static int shm_rx = -1;
+static int shm_tx = -1;
+/* what the publisher thread puts there, not on its stack */
+static util::shm_port rx_snapshot;
+static util::shm_port tx_snapshot;
+/*
+ * What the RX thread counts. It and rx_gaps are written by the RX thread
+ * only, with rx_seq odd meanwhile, and copied out by the publisher thread,
+ * which retries a torn copy: the shm_stats seqlock again, so the RX loop
+ * never waits for, nor copies for, a publish.
+ */
+static struct {
+	uint64_t packets;
+	uint64_t errors;
+	uint64_t missed;
+	uint64_t resets;
+} rx_counts;
+static std::atomic<uint32_t> rx_seq;
+/* bytes sent, the TX thread's only */
+static std::atomic<uint64_t> tx_count;
+/* how rt_init() locks memory, -m */
+static util::rt_memory memory_mode = util::RT_MEMORY_ALL;
+/* minor faults of each thread in its loop, should stay 0 */
+static long rx_faults;
+static long tx_faults;
+
+static long thread_minflt()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_THREAD, &usage);
+
+	return usage.ru_minflt;
+}
+
+static void publish(int port, util::shm_port *p, const char *state)
+{
+	if (port < 0)
+		return;
+
+	strncpy(p->state, state, sizeof(p->state) - 1);
+	p->updated_ns = util::monotonic_clock::now().time_since_epoch().count();
+	shm.publish(port, *p);
+}
+
+static void rx_update_begin()
+{
+	rx_seq.store(rx_seq.load(memory_order_relaxed) + 1,
+		memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void rx_update_end()
+{
+	rx_seq.store(rx_seq.load(memory_order_relaxed) + 1,
+		memory_order_release);
+}
+
+/* rx_counts and rx_gaps into rx_snapshot, false if only torn copies */
+static bool copy_rx_counts(uint64_t *resets)
+{
+	util::shm_port *p = &rx_snapshot;
+
+	for (int i = 0; i < publish_retries; ++i) {
+		const uint32_t seq = rx_seq.load(memory_order_acquire);
+
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+
+		p->rx_packets = rx_counts.packets;
+		p->rx_errors = rx_counts.errors;
+		p->rx_missed = rx_counts.missed;
+		p->latency = rx_gaps;
+		*resets = rx_counts.resets;
+		atomic_thread_fence(memory_order_acquire);
+
+		if (rx_seq.load(memory_order_relaxed) == seq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Publishes both ports every publish_period_ms, "reset" for a round in
+ * which the RX thread reset the port. Drops the rt class the threads
+ * inherit, the ~15 KB histogram copy runs below the testers, unpinned.
+ */
+static void *thread_publish(void *)
+{
+	struct sched_param param;
+	uint64_t seen = 0;
+
+	param.sched_priority = 0;
+	pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+
+	while (!exit_requested.stop_requested()) {
+		struct timespec ts = { 0, publish_period_ms * 1000000 };
+
+		nanosleep(&ts, 0);
+
+		uint64_t resets;
+
+		if (copy_rx_counts(&resets)) {
+			publish(shm_rx, &rx_snapshot,
+				resets != seen ? "reset" : "running");
+			seen = resets;
+		}
+
+		tx_snapshot.tx_packets = tx_count.load(memory_order_relaxed);
+		publish(shm_tx, &tx_snapshot, "running");
+	}
+
+	return 0;
+}
 
 // Signal handler for CTRL-C and such.
 void signal_handler(int signum)
 {
-	exit_requested = true;
+	exit_requested.request_stop();
 }
 
 /*
@@ -72,12 +215,56 @@ void* thread_uart_rx(void *arg)
 	util::serial *sp = (util::serial *)arg;
 	int8_t rxchar = 0;
 	int8_t rxnext = 0;
+	/*
+	 * The first byte is wherever the other end's counter is, the
+	 * recorder is only armed from the first one in sequence on.
+	 */
+	bool synced = false;
+	unique_ptr<util::serial_backend> io(
+		util::make_serial_backend(backend, sp->fd()));
+	util::monotonic_clock::time_point last;
 
 	setup_thread_stack_minimal(thread_stack_size);
 
-	while (!exit_requested) {
-		if (read(sp->fd(), &rxchar, 1) == 1) {
-			if (rxchar != rxnext) {
+	if (!io || (tester_cpu >= 0 &&
+		    !util::rt_set_processor_affinity(tester_cpu))) {
+		exit_requested.request_stop();
+		return 0;
+	}
+
+	rx_faults = thread_minflt();
+
+	while (!exit_requested.stop_requested()) {
+		if (io->read(&rxchar, 1) == 1) {
+			auto now = util::monotonic_clock::now();
+			const uint8_t gap = rxchar - rxnext;
+
+			rx_update_begin();
+			if (last.time_since_epoch().count())
+				rx_gaps.add((now - last).count());
+			rx_counts.packets++;
+			if (gap) {
+				rx_counts.errors++;
+				if (gap < 128)
+					rx_counts.missed += gap;
+			}
+			rx_update_end();
+			last = now;
+
+			trace.record(util::TRACE_RX, util::TRACE_BYTE,
+				(uint8_t)rxchar, (uint8_t)rxnext);
+
+			if (gap) {
+				trace.record(util::TRACE_RX, util::TRACE_ERROR,
+					(uint8_t)rxchar, (uint8_t)rxnext);
+				/* an ioctl, not for every byte before the sync */
+				if (synced) {
+					trace.record_counters(sp->fd());
+					if (trace.freeze(util::TRACE_ERROR))
+						cout << util::timestamp()
+							<< "trace frozen\r\n";
+				}
+
 				cout << util::timestamp();
 				printf("err: exp %4d, received %4d\n",
 					rxnext, rxchar);
@@ -93,26 +280,62 @@ void* thread_uart_rx(void *arg)
 					 * from clock drifts.
 					 * Trying to handle it in a proper way
 					 */
+					trace.record(util::TRACE_RX,
+						util::TRACE_RESET, 0);
+					rx_update_begin();
+					rx_counts.resets++;
+					rx_update_end();
+					synced = false;
 					sp->reset();
+					io.reset(util::make_serial_backend(
+						backend, sp->fd()));
+					if (!io) {
+						exit_requested.request_stop();
+						break;
+					}
 				}
+			} else {
+				synced = true;
 			}
 			rxnext = rxchar + 1;
 		}
 	}
+
+	rx_faults = thread_minflt() - rx_faults;
+
+	return 0;
 }
 
 void* thread_uart_tx(void *arg)
 {
 	util::serial *sp = (util::serial *)arg;
 	int8_t counter = 0;
+	unique_ptr<util::serial_backend> io(
+		util::make_serial_backend(backend, sp->fd()));
 
 	setup_thread_stack_minimal(thread_stack_size);
 
-	while (!exit_requested) {
-		if (write(sp->fd(), &counter, 1) == 1) {
+	if (!io || (tester_cpu >= 0 &&
+		    !util::rt_set_processor_affinity(tester_cpu))) {
+		exit_requested.request_stop();
+		return 0;
+	}
+
+	tx_faults = thread_minflt();
+
+	while (!exit_requested.stop_requested()) {
+		if (io->write(&counter, 1) == 1) {
+			trace.record(util::TRACE_TX, util::TRACE_BYTE,
+				(uint8_t)counter);
 			counter++;
+			tx_count.store(tx_count.load(memory_order_relaxed) + 1,
+				memory_order_relaxed);
 		}
 	}
+
+	tx_faults = thread_minflt() - tx_faults;
+
+	return 0;
 }
 
 bool is_linux_rt()
@@ -140,22 +363,30 @@ bool is_linux_rt()
 /*
  * Here we create a thread with minimal stack, to leave as much as possible
  * memory space in physical ram to other applications.
+ *
+ * In budget mode the stack is an rt_alloc() one, locked and faulted in,
+ * returned to be freed after the join. 0 otherwise.
  */
 
 typedef void *(*start_routine) (void *);
 
-static void start_rt_thread(pthread_t *tid, start_routine run_routine, void *arg)
+static const size_t rt_stack_size = PTHREAD_STACK_MIN + thread_stack_size;
+
+static void *start_rt_thread(pthread_t *tid, start_routine run_routine,
+			     void *arg)
 {
 	pthread_t thread;
 	pthread_attr_t attr;
+	void *stack = 0;
 	int err;
 
 	/* init to default values */
 	if (pthread_attr_init(&attr))
 		cout << "++err: start_rt_thread(), can't set attributes";
 	/* Set the requested stacksize for this thread */
-	if (pthread_attr_setstacksize(&attr,
-		PTHREAD_STACK_MIN + thread_stack_size))
+	if (memory_mode == util::RT_MEMORY_BUDGET)
+		stack = util::rt_thread_stack(&attr, rt_stack_size);
+	if (!stack && pthread_attr_setstacksize(&attr, rt_stack_size))
 		cout << "++err: start_rt_thread(), can't set stack size";
 	/* And finally start the actual thread */
 	err = pthread_create(tid, &attr, run_routine, arg);
@@ -163,12 +394,83 @@ static void start_rt_thread(pthread_t *tid, start_routine run_routine, void *arg
 	if (err != 0)
             cout << "++err: start_rt_thread(), can't create thread :[" <<
 		 strerror(err) << "]\n";
+
+	pthread_attr_destroy(&attr);
+
+	return stack;
+}
+
+enum irq_layout {
+	IRQ_LAYOUT_NONE,
+	IRQ_LAYOUT_COLOCATE,
+	IRQ_LAYOUT_ISOLATE,
+};
+
+/* first cpu we may run on other than the tester one, -1 if none */
+static int other_cpu(int cpu)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == -1)
+		return -1;
+
+	for (int i = 0; i < CPU_SETSIZE; ++i)
+		if (CPU_ISSET(i, &set) && i != cpu)
+			return i;
+
+	return -1;
 }
 
-int run(const string& device)
+/*
+ * Gives the irq threads of the port irq_prio, and places them next to
+ * or away from the tester threads. Whatever is changed is restored when
+ * irq goes out of scope.
+ */
+static void setup_irq(util::irq_tuning *irq, const string &device,
+		      int prio, int irq_prio, irq_layout layout)
+{
+	if (!irq->find(device))
+		return;
+
+	if (irq_prio > 0) {
+		if (!irq->num_threads())
+			cout << "++err: no irq threads, threadirqs or "
+				"PREEMPT RT needed for -q\r\n";
+		else
+			irq->set_priority(irq_prio);
+	}
+
+	if (layout == IRQ_LAYOUT_COLOCATE) {
+		irq->set_affinity(tester_cpu);
+
+		for (const util::irq_line &l : irq->lines()) {
+			for (const util::irq_thread &t : l.threads) {
+				int p = irq_prio > 0 ? irq_prio : t.prio;
+
+				if (prio && p <= prio)
+					cout << "++warn: " << t.comm
+						<< " not above the tester on "
+						"the same cpu, RX can starve "
+						"it\r\n";
+			}
+		}
+	} else if (layout == IRQ_LAYOUT_ISOLATE) {
+		int cpu = other_cpu(tester_cpu);
+
+		if (cpu < 0)
+			cout << "++err: no cpu left to isolate the irq on\r\n";
+		else
+			irq->set_affinity(cpu);
+	}
+}
+
+int run(const string& device, const string& trace_file,
+	const string& stats_name, int prio, int irq_prio, irq_layout layout)
 {
 	int err;
-	pthread_t tid[2];
+	pthread_t tid[3];
+	void *stack[3] = { 0, 0, 0 };
+	util::irq_tuning irq;
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
@@ -176,11 +478,88 @@ int run(const string& device)
 	util::serial sp(device);
 	sp.set_speed(B115200);
 
-	start_rt_thread(&tid[0], thread_uart_rx, &sp);
-	start_rt_thread(&tid[1], thread_uart_tx, &sp);
+	setup_irq(&irq, device, prio, irq_prio, layout);
+
+	if (prio)
+		cout << "tester threads: SCHED_RR " << prio << ", cpu ";
+	else
+		cout << "tester threads: SCHED_OTHER, cpu ";
+	if (tester_cpu >= 0)
+		cout << tester_cpu << "\r\n";
+	else
+		cout << "any\r\n";
+	irq.print();
+
+	if (!load.empty()) {
+		cpu_set_t cpus;
+
+		/* all but the tester's, unless that leaves none */
+		sched_getaffinity(0, sizeof(cpus), &cpus);
+		if (tester_cpu >= 0 && CPU_COUNT(&cpus) > 1) {
+			CPU_CLR(tester_cpu, &cpus);
+			load.set_cpus(cpus);
+		}
+
+		cout << "load: " << load.profile() << "\r\n";
+		if (!load.start())
+			return 1;
+	}
+
+	if (!trace_file.empty() && trace.open(trace_file, trace_records))
+		cout << util::timestamp() << "recording trace to "
+			<< trace_file << "\r\n";
+
+	/* set up before the threads, the publisher only ever publishes */
+	if (!stats_name.empty() && shm.create(stats_name, "rtt")) {
+		strncpy(rx_snapshot.name, (device + " rx").c_str(),
+			sizeof(rx_snapshot.name) - 1);
+		strncpy(tx_snapshot.name, (device + " tx").c_str(),
+			sizeof(tx_snapshot.name) - 1);
+		shm_rx = shm.add_port(rx_snapshot.name);
+		shm_tx = shm.add_port(tx_snapshot.name);
+		cout << util::timestamp() << "live stats in " << stats_name
+			<< "\r\n";
+	}
+
+	/* mapped after rt_init(), so not under MCL_CURRENT */
+	if (memory_mode == util::RT_MEMORY_BUDGET) {
+		if (trace.enabled())
+			util::rt_lock(trace.header(), trace.size());
+		if (shm.valid())
+			util::rt_lock(shm.segment(), sizeof(util::shm_segment));
+	}
+
+	util::rt_memory_report("start");
+
+	stack[0] = start_rt_thread(&tid[0], thread_uart_rx, &sp);
+	stack[1] = start_rt_thread(&tid[1], thread_uart_tx, &sp);
+	if (shm.valid())
+		stack[2] = start_rt_thread(&tid[2], thread_publish, 0);
 
 	pthread_join(tid[0], 0);
 	pthread_join(tid[1], 0);
+	if (shm.valid()) {
+		uint64_t resets;
+
+		pthread_join(tid[2], 0);
+		/* the last word, everyone else is gone */
+		copy_rx_counts(&resets);
+		publish(shm_rx, &rx_snapshot, "stopped");
+		tx_snapshot.tx_packets = tx_count.load();
+		publish(shm_tx, &tx_snapshot, "stopped");
+	}
+	load.stop();
+
+	util::rt_memory_report("end");
+	cout << "faults in the loops: rx " << rx_faults << ", tx "
+		<< tx_faults << "\r\n";
+	util::rt_free(stack[0], rt_stack_size);
+	util::rt_free(stack[1], rt_stack_size);
+	util::rt_free(stack[2], rt_stack_size);
+
+	rx_gaps.print("RX inter-arrival");
+	if (!load.empty())
+		load.print();
 
 	return 0;
 }
@@ -189,12 +568,91 @@ int run(const string& device)
 
 void usage()
 {
-	cout << "usage: rtt device [prio]\r\n\r\n";
+	cout << "usage: rtt [-b backend] [-a cpu] [-q irqprio] "
+		"[-l colocate|isolate]\r\n"
+		"           [-t tracefile] [-s stats] [-L load] "
+		"[-m all|budget]\r\n"
+		"           device [prio]\r\n\r\n"
+		"  -b name  serial I/O backend: plain (default), epoll,\r\n"
+		"           io_uring or io_uring-sqpoll\r\n"
+		"  -a cpu   pin the tester threads to cpu\r\n"
+		"  -q prio  SCHED_FIFO prio of the port irq threads, default\r\n"
+		"           tester prio + 1 on PREEMPT RT, 0 leaves them be\r\n"
+		"  -l mode  irqs on the tester cpu (colocate) or away from\r\n"
+		"           it (isolate), needs -a\r\n"
+		"  -t file  flight recorder file, default rtt.trace,\r\n"
+		"           an empty name disables it\r\n"
+		"  -s name  publish live stats for rtstat in shared memory\r\n"
+		"           /name\r\n"
+		"  -L load  background load while testing, specs joined by\r\n"
+		"           '+': kind[:workers][@cpus][%duty][/size], kind\r\n"
+		"           cpu, mem, fault, fork, ipc or net, off the -a cpu\r\n"
+		"  -m mode  memory locking on PREEMPT RT: all (default)\r\n"
+		"           locks everything, budget only the stacks, the\r\n"
+		"           trace ring and the stats\r\n"
+		"\r\n";
 }
 
 int main(int argc, char *argv[])
 {
-	if (argc <= 1) {
+	string trace_file = "rtt.trace";
+	string stats_name;
+	int irq_prio = -1;
+	peloton::irq_layout layout = peloton::IRQ_LAYOUT_NONE;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:b:l:m:q:s:t:L:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			peloton::tester_cpu = atoi(optarg);
+			break;
+		case 'b':
+			peloton::backend = optarg;
+			break;
+		case 'l':
+			if (!strcmp(optarg, "colocate")) {
+				layout = peloton::IRQ_LAYOUT_COLOCATE;
+			} else if (!strcmp(optarg, "isolate")) {
+				layout = peloton::IRQ_LAYOUT_ISOLATE;
+			} else {
+				usage();
+				exit(0);
+			}
+			break;
+		case 'm':
+			if (!strcmp(optarg, "all")) {
+				peloton::memory_mode = util::RT_MEMORY_ALL;
+			} else if (!strcmp(optarg, "budget")) {
+				peloton::memory_mode = util::RT_MEMORY_BUDGET;
+			} else {
+				usage();
+				exit(0);
+			}
+			break;
+		case 'q':
+			irq_prio = atoi(optarg);
+			break;
+		case 's':
+			stats_name = optarg;
+			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'L':
+			if (!peloton::load.parse(optarg))
+				exit(1);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc <= 1 || (layout != peloton::IRQ_LAYOUT_NONE &&
+			  peloton::tester_cpu < 0)) {
 		usage();
 		exit(0);
 	}
@@ -215,11 +673,24 @@ int main(int argc, char *argv[])
 
 	cout << util::timestamp() << "starting ...\r\n";
 
+	int tester_prio = 0;
+
 	if (peloton::is_linux_rt()) {
-		util::rt_init();
+		util::rt_init(peloton::memory_mode);
 		util::rt_set_thread_prio_or_die(priority);
+		tester_prio = priority;
+
+		/* the irq thread has to win over our RX spinner */
+		if (irq_prio < 0)
+			irq_prio = priority < 99 ? priority + 1 : 99;
+	}
+
+	if (irq_prio > 99) {
+		cout << "++err: invalid irq priority\n";
+		exit(0);
 	}
 
-	return peloton::run(argv[1]);
+	return peloton::run(argv[1], trace_file, stats_name, tester_prio,
+		irq_prio, layout);
 }
 
@@ -0,0 +1,361 @@
+/*
+ * Serial I/O backend comparison.
+ *
+ * For every util::serial_backend, over a pty pair (a loopback TCP
+ * connection for the network ones, two raw sockets on vcan0 for can):
+ * streaming throughput with the process cpu time it costs per MB, then
+ * the latency of small blocks bounced from the master to the slave end,
+ * one at a time, checked on arrival, and whatever counters the backends
+ * keep. Each block leaves a short gap after the slave end started
+ * reading, so that it is the backends' ways of waiting (spinning, poll,
+ * epoll, io_uring) that get timed, not a read of data already there. can also reports how many frames came with a kernel timestamp.
+ * It is skipped without AF_CAN or a vcan0 interface:
+ *
+ *   ip link add dev vcan0 type vcan && ip link set vcan0 up
+ *
+ * usage: bench_backends [seconds [backend ...]]
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <thread>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+
+#include "cacheline.hh"
+#include "clock.hh"
+#include "serial_io.hh"
+#include "stats.hh"
+
+using namespace nomovok;
+
+namespace {
+
+const size_t kStreamBlock = 256;
+// Big enough for MSG_ZEROCOPY to kick in.
+const size_t kNetStreamBlock = 65536;
+const size_t kPingBlock = 16;
+const int kPings = 2000;
+// Well within adaptive_backend::max_spin_ns, for its spinning to show.
+const int kPingGapUs = 20;
+const char *kCanInterface = "vcan0";
+// make_serial_backend()'s default for can.
+const int kCanId = 0x100;
+
+double CpuSeconds()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A raw, non-blocking pty pair: master is our "peer", slave the port.
+bool OpenPtyPair(int *master, int *slave)
+{
+	struct termios t;
+
+	*master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (*master == -1 || grantpt(*master) || unlockpt(*master))
+		return false;
+
+	*slave = open(ptsname(*master), O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (*slave == -1)
+		return false;
+
+	tcgetattr(*slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(*slave, TCSANOW, &t);
+
+	return true;
+}
+
+// The same over a loopback TCP connection, for the network backends.
+bool OpenTcpPair(int *master, int *slave)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int on = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 1) || getsockname(fd, (struct sockaddr *)&addr, &len))
+		return false;
+
+	*master = util::tcp_connect("127.0.0.1:" +
+		::std::to_string(ntohs(addr.sin_port)));
+	*slave = accept(fd, 0, 0);
+	close(fd);
+
+	if (*master == -1 || *slave == -1)
+		return false;
+
+	setsockopt(*slave, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	fcntl(*slave, F_SETFL, fcntl(*slave, F_GETFL) | O_NONBLOCK);
+
+	return true;
+}
+
+// A send only CAN socket and one receiving its frames, vcan echoes them
+// to the other sockets of the host.
+bool OpenCanPair(int *master, int *slave)
+{
+	*master = util::can_open(kCanInterface, -1);
+	*slave = util::can_open(kCanInterface, kCanId);
+
+	return *master != -1 && *slave != -1;
+}
+
+bool IsNetwork(const char *name)
+{
+	return !strncmp(name, "tcp", 3) || !strcmp(name, "rfc2217");
+}
+
+bool IsCan(const char *name)
+{
+	return !strncmp(name, "can", 3);
+}
+
+// Blocks of block bytes, never touched once filled, as zerocopy wants.
+void Stream(util::serial_backend *tx, util::serial_backend *rx,
+	    size_t block, double seconds, double *mb_per_s,
+	    double *cpu_ms_per_mb)
+{
+	static uint8_t out[kNetStreamBlock];
+	static uint8_t in[kNetStreamBlock];
+	util::stop_token stop;
+	uint64_t received = 0;
+
+	memset(out, 0x55, block);
+
+	const double cpu_start = CpuSeconds();
+	const auto start = util::monotonic_clock::now();
+
+	::std::thread writer([&]() {
+		while (!stop.stop_requested())
+			tx->write(out, block);
+	});
+
+	const auto end = start + ::std::chrono::microseconds(
+		(uint64_t)(seconds * 1e6));
+
+	while (util::monotonic_clock::now() < end) {
+		ssize_t n = rx->read(in, block);
+
+		if (n > 0)
+			received += n;
+	}
+
+	stop.request_stop();
+	writer.join();
+
+	const double elapsed =
+		util::duration_in_seconds(util::monotonic_clock::now() - start);
+	const double mb = received / 1e6;
+
+	*mb_per_s = mb / elapsed;
+	*cpu_ms_per_mb = mb > 0 ? (CpuSeconds() - cpu_start) * 1000 / mb : 0;
+}
+
+uint64_t NowNs()
+{
+	return util::monotonic_clock::now().time_since_epoch().count();
+}
+
+// Block i is i, i + 1 ..., so that what comes back can be checked.
+void FillBlock(uint8_t *p, int i)
+{
+	for (size_t j = 0; j < kPingBlock; ++j)
+		p[j] = i + j;
+}
+
+// Block i goes out kPingGapUs after the reader asked for it, timed from
+// there to the end of the read.
+void Ping(util::serial_backend *tx, util::serial_backend *rx,
+	  util::histogram *latency, int *mismatches)
+{
+	::std::atomic<int> wanted(-1);
+	::std::atomic<uint64_t> sent_ns(0);
+	uint8_t expected[kPingBlock];
+	uint8_t in[kPingBlock];
+
+	::std::thread writer([&]() {
+		uint8_t out[kPingBlock];
+
+		// The default 50 us slack would swamp the gap.
+		prctl(PR_SET_TIMERSLACK, 1);
+
+		for (int i = 0; i < kPings; ++i) {
+			size_t sent = 0;
+
+			while (wanted.load() != i)
+				::std::this_thread::yield();
+			::std::this_thread::sleep_for(
+				::std::chrono::microseconds(kPingGapUs));
+
+			FillBlock(out, i);
+			sent_ns.store(NowNs());
+			while (sent < sizeof(out)) {
+				ssize_t n = tx->write(out + sent,
+					sizeof(out) - sent);
+
+				if (n > 0)
+					sent += n;
+			}
+		}
+	});
+
+	*mismatches = 0;
+
+	for (int i = 0; i < kPings; ++i) {
+		size_t got = 0;
+
+		wanted.store(i);
+		while (got < sizeof(in)) {
+			ssize_t n = rx->read(in + got, sizeof(in) - got);
+
+			if (n > 0)
+				got += n;
+		}
+
+		latency->add(NowNs() - sent_ns.load());
+		FillBlock(expected, i);
+		if (memcmp(in, expected, sizeof(in)))
+			++*mismatches;
+	}
+
+	writer.join();
+}
+
+// A fresh pty pair with a backend on each end, so nothing left in
+// flight by one phase leaks into the next.
+struct Link {
+	int master;
+	int slave;
+	::std::unique_ptr<util::serial_backend> tx;
+	::std::unique_ptr<util::serial_backend> rx;
+
+	explicit Link(const char *name) : master(-1), slave(-1) {
+		// No AF_CAN or no vcan0 is a backend not available.
+		if (IsCan(name)) {
+			if (!OpenCanPair(&master, &slave))
+				return;
+		} else if (!(IsNetwork(name) ? OpenTcpPair(&master, &slave) :
+			     OpenPtyPair(&master, &slave))) {
+			perror("can't open a pty or tcp pair");
+			exit(-1);
+		}
+		tx.reset(util::make_serial_backend(name, master));
+		rx.reset(util::make_serial_backend(name, slave));
+	}
+
+	~Link() {
+		tx.reset();
+		rx.reset();
+		if (slave != -1)
+			close(slave);
+		if (master != -1)
+			close(master);
+	}
+
+	bool ok() const { return tx && rx; }
+};
+
+void Run(const char *name, double seconds)
+{
+	double mb_per_s, cpu_ms_per_mb;
+	util::histogram latency;
+	int mismatches;
+
+	printf("==== %s ====\n", name);
+
+	{
+		Link link(name);
+
+		if (!link.ok()) {
+			printf("not available\n");
+			return;
+		}
+		Stream(link.tx.get(), link.rx.get(),
+			IsNetwork(name) ? kNetStreamBlock : kStreamBlock,
+			seconds, &mb_per_s, &cpu_ms_per_mb);
+
+		printf("Throughput MB/s = %.2f\n", mb_per_s);
+		printf("CPU ms/MB = %.2f\n", cpu_ms_per_mb);
+		link.tx->print_stats();
+	}
+
+	{
+		Link link(name);
+
+		Ping(link.tx.get(), link.rx.get(), &latency, &mismatches);
+		latency.print("Block latency");
+		printf("Blocks mismatched = %d of %d\n", mismatches, kPings);
+		link.rx->print_stats();
+
+		if (IsCan(name)) {
+			const util::can_backend *can =
+				static_cast<util::can_backend *>(link.rx.get());
+
+			printf("CAN frames timestamped = %llu of %llu\n",
+				(unsigned long long)can->rx_delay().count(),
+				(unsigned long long)can->frames_in());
+		}
+	}
+
+	fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+	static const char *backends[] = {
+		// adaptive=50 spins whatever the tuning would make of the
+		// machine, with a single cpu it settles on poll() only.
+		"plain", "epoll", "adaptive", "adaptive=50", "io_uring",
+		"io_uring-sqpoll", "tcp", "tcp-zerocopy", "rfc2217", "can"
+	};
+	double seconds = 1;
+
+	if (argc > 1)
+		seconds = atof(argv[1]);
+
+	// Backends to compare can be named after the duration.
+	if (argc > 2) {
+		for (int i = 2; i < argc; ++i)
+			Run(argv[i], seconds);
+		return 0;
+	}
+
+	for (const char *b : backends) {
+		// The sqpoll thread needs a core, we'd starve it spinning.
+		if (!strcmp(b, "io_uring-sqpoll") &&
+		    sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+			printf("==== %s ====\nskipped, needs 2 cpus\n", b);
+			continue;
+		}
+		Run(b, seconds);
+	}
+
+	return 0;
+}
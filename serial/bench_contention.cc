@@ -0,0 +1,166 @@
+/*
+ * Contention microbenchmark for the tester state layout.
+ *
+ * Two threads on two cores each bump their own tester counters, as the
+ * TX and RX loops of stt do, while polling a shared stop flag. Once with
+ * the old layout (two small testers next to each other, a plain bool flag)
+ * and once with the cache line isolated one. The hardware cache miss
+ * counter shows the coherence traffic the old layout costs.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "cacheline.hh"
+#include "clock.hh"
+
+using namespace nomovok;
+
+namespace {
+
+// The per-thread state of the old UartTester, two of them on the stack.
+struct PackedState {
+	int8_t counter;
+	uint64_t num_successes;
+};
+
+struct Packed {
+	PackedState tx;
+	PackedState rx;
+	bool exit_requested;
+
+	bool Stopped() const
+	{ return *(volatile const bool *)&exit_requested; }
+};
+
+struct alignas(util::cache_line_size) IsolatedState {
+	int8_t counter;
+	uint64_t num_successes;
+};
+
+struct Isolated {
+	IsolatedState tx;
+	IsolatedState rx;
+	util::stop_token exit_requested;
+
+	bool Stopped() const { return exit_requested.stop_requested(); }
+};
+
+void Pin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+template <typename Layout, typename State>
+void Spin(const Layout *layout, State *state, uint64_t iterations, int cpu)
+{
+	volatile State *s = state;
+
+	Pin(cpu);
+
+	for (uint64_t i = 0; i < iterations && !layout->Stopped(); ++i) {
+		s->counter = s->counter + 1;
+		s->num_successes = s->num_successes + 1;
+	}
+}
+
+// Hardware cache misses of this process and the threads it creates,
+// -1 if the PMU isn't accessible (perf_event_paranoid, VMs).
+int OpenMissCounter()
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+template <typename Layout>
+void Run(const char *title, uint64_t iterations, int cpu_tx, int cpu_rx)
+{
+	// static, new doesn't honour alignas before C++17
+	static Layout storage;
+	Layout *layout = &storage;
+	int fd = OpenMissCounter();
+	int err = errno;
+
+	if (fd != -1)
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+
+	const auto start = util::monotonic_clock::now();
+
+	std::thread tx(Spin<Layout, decltype(layout->tx)>, layout,
+		       &layout->tx, iterations, cpu_tx);
+	std::thread rx(Spin<Layout, decltype(layout->rx)>, layout,
+		       &layout->rx, iterations, cpu_rx);
+	tx.join();
+	rx.join();
+
+	const double elapsed =
+		util::duration_in_seconds(util::monotonic_clock::now() - start);
+	const uint64_t ops = layout->tx.num_successes +
+		layout->rx.num_successes;
+
+	printf("==== %s ====\n", title);
+	printf("Threads on cpus = %d,%d\n", cpu_tx, cpu_rx);
+	printf("Elapsed time = %.6f\n", elapsed);
+	printf("Avg ops/s = %.2f\n", ops / elapsed);
+	printf("Avg ns/op = %.3f\n", elapsed * 1e9 / ops);
+
+	if (fd != -1) {
+		uint64_t misses = 0;
+
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) == sizeof(misses))
+			printf("Cache misses/op = %.4f\n",
+				(double)misses / ops);
+		close(fd);
+	} else {
+		printf("Cache misses/op = n/a (%s)\n", strerror(err));
+	}
+}
+
+}  // namespace
+
+int main(int argc, char *argv[])
+{
+	uint64_t iterations = 100 * 1000 * 1000;
+	const int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc > 1)
+		iterations = strtoull(argv[1], 0, 0);
+
+	if (cpus < 2)
+		printf("only one cpu online, there is no cross-core traffic "
+			"to measure\n");
+
+	Run<Packed>("packed (old layout)", iterations, 0, 1 % cpus);
+	Run<Isolated>("isolated", iterations, 0, 1 % cpus);
+
+	return 0;
+}
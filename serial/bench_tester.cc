@@ -0,0 +1,85 @@
+/*
+ * Tester instantiation benchmark.
+ *
+ * Runs every payload width / verification policy / I/O strategy
+ * combination of UartTester over a local socket pair, a TX thread on one
+ * end and a RX thread on the other, and prints their throughput.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cacheline.hh"
+#include "clock.hh"
+
+#include "uart_tester.hh"
+
+using namespace nomovok;
+
+namespace peloton {
+
+void Run(int payload_bits, const char *verify, const char *io, double seconds)
+{
+	int sv[2];
+
+	PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+
+	auto tester_tx = MakeTester(sv[0], payload_bits, verify, io);
+	auto tester_rx = MakeTester(sv[1], payload_bits, verify, io);
+	util::stop_token stop;
+
+	const auto start = util::monotonic_clock::now();
+
+	::std::thread tx(&Tester::SendUntilCancelled, tester_tx.get(),
+		::std::cref(stop), UINT64_MAX);
+	::std::thread rx(&Tester::ReceiveUntilCancelled, tester_rx.get(),
+		::std::cref(stop), UINT64_MAX);
+
+	::std::this_thread::sleep_for(
+		::std::chrono::microseconds((uint64_t)(seconds * 1e6)));
+	stop.request_stop();
+	tx.join();
+	rx.join();
+
+	const double elapsed =
+		util::duration_in_seconds(util::monotonic_clock::now() - start);
+	const double per_sec = tester_rx->num_successes() / elapsed;
+
+	printf("%-22s %14.0f payloads/s %10.2f MB/s %10" PRIu64 " errors\n",
+		tester_rx->name().c_str(), per_sec,
+		per_sec * payload_bits / 8 / 1e6, tester_rx->num_errors());
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+}  // namespace peloton
+
+int main(int argc, char *argv[])
+{
+	static const int widths[] = { 8, 16, 32, 64 };
+	static const char *verifies[] = { "fatal", "log", "count" };
+	static const char *ios[] = { "single", "batched", "vectored" };
+	double seconds = 0.25;
+
+	if (argc > 1)
+		seconds = atof(argv[1]);
+
+	for (int w : widths)
+		for (const char *v : verifies)
+			for (const char *io : ios)
+				::peloton::Run(w, v, io, seconds);
+
+	return 0;
+}
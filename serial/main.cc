@@ -15,8 +15,10 @@
  */
 
 #include <cinttypes>
+#include <cmath>
 #include <csignal>
 #include <cstdint>
+#include <cstring>
 
 #include <chrono>
 #include <atomic>
@@ -27,18 +29,89 @@
 #include "gflags/gflags.h"
 #include "glog/logging.h"
 
+#include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 
 #include "serial.hh"
 #include "realtime.hh"
 #include "general.hh"
+#include "cacheline.hh"
 #include "clock.hh"
+#include "load.hh"
+#include "replay.hh"
+#include "session.hh"
+#include "shmstats.hh"
+#include "stats.hh"
+
+#include "uart_tester.hh"
 
 DEFINE_string(port, "/dev/ttyS0", "Serial port to send/receive on.");
 DEFINE_int32(baud_rate, 115200, "Baud rate at which to send/receive.");
 DEFINE_uint64(num_packets, UINT64_MAX, "Number of packets to read/write.");
 DEFINE_bool(missed_packets_fatal, true,
             "If true, die on any missed packets.  Otherwise log a warning.");
+DEFINE_int32(payload_bits, 8, "Counter payload width: 8, 16, 32 or 64.");
+DEFINE_string(verify, "",
+              "On out of sequence payloads: fatal, log or count. Empty to "
+              "follow --missed_packets_fatal, or log with --replay.");
+DEFINE_string(io, "single",
+              "I/O strategy: single (a payload per syscall), batched or "
+              "vectored.");
+DEFINE_string(backend, "plain",
+              "I/O backend: plain, loopback (in memory, the port is "
+              "left alone), epoll, adaptive (spin, then poll), "
+              "adaptive=<spin us> (0 to only poll), can, tcp, rfc2217, "
+              "io_uring or io_uring-sqpoll. Backends other than plain "
+              "need --io=batched. With can, --port is the CAN interface, "
+              "with tcp and rfc2217 the device server's host:port.");
+DEFINE_int32(can_id, 0x100, "CAN id of the frames sent with --backend=can.");
+DEFINE_int32(can_rx_id, -1,
+             "CAN id of the frames to receive, the peer's --can_id. -1 for "
+             "--can_id, a local loopback as on vcan.");
+DEFINE_bool(latency, false,
+            "Port looped back to itself: measure the round trip of every "
+            "payload. Needs --payload_bits of 16 or more.");
+DEFINE_bool(session, false,
+            "Coordinate with the tool on the other end: agree on the "
+            "config over the link, start together, run for --duration and "
+            "exchange counters, for end to end loss both ways.");
+DEFINE_double(duration, 10.0,
+              "Seconds to run with --session, and per phase with "
+              "--load_compare.");
+DEFINE_int32(quiesce_ms, 500,
+             "With --session, time to keep receiving after sending stopped.");
+DEFINE_bool(one_way, false,
+            "With --session, estimate the other end's clock before and "
+            "after the run and print the one-way latency both ways. Needs "
+            "--payload_bits of 16 or more.");
+DEFINE_string(load, "",
+              "Background load while testing, specs joined by '+': "
+              "kind[:workers][@cpus][%duty][/size], kind one of cpu, mem, "
+              "fault, fork, ipc or net, e.g. cpu:2@1-2+mem/64M%50+fork.");
+DEFINE_bool(load_compare, false,
+            "Port looped back to itself: run --duration without, then "
+            "--duration with --load, and print both side by side.");
+DEFINE_string(rt_memory, "all",
+              "Memory locking: all locks everything, as ever; budget only "
+              "the testers, their timestamps and the top of the loop "
+              "stacks, for small boards.");
+DEFINE_string(stats_shm, "",
+              "Publish live counters for rtstat in shared memory /<name>, "
+              "empty for none.");
+DEFINE_string(replay, "",
+              "Trace or raw capture to replay onto the port, verified by "
+              "the receiver instead of running the counter stream.");
+DEFINE_string(replay_format, "trace", "Replay file format: trace or raw.");
+DEFINE_string(replay_direction, "rx",
+              "Direction of the trace to replay: rx (what the traced "
+              "side received) or tx.");
+DEFINE_double(replay_speed, 1.0,
+              "Replay timing scale: 1 original, 2 twice as fast, "
+              "0 as fast as possible.");
+DEFINE_bool(replay_pty, false,
+            "Replay onto an internal pty pair and verify on its slave end, "
+            "instead of using --port.");
 
 using namespace nomovok;
 using namespace std;
@@ -47,112 +120,8 @@ namespace peloton {
 
 const char usage[] = "Usage: uart_rt_test <options>";
 
-::std::atomic_bool exit_requested{false};
-
-// Helper class to take care of actually sending CAN frames and receiving them.
-// One one side of the CAN interface, call the `Send` function in a loop and on
-// the other call the `Receive` function in a loop.
-class UartTester
-{
-public:
-	UartTester(int fd) :
-	fd_(fd),
-	counter_(0),
-	num_successes_(0),
-	start_time_(util::monotonic_clock::min_time)
-	{}
-
-	// Send a single value with an incrementing counter value.
-	void Send() {
-		if (WritePacket(counter_)) {
-			CaptureStartTime();
-			++counter_;
-			++num_successes_;
-		}
-	}
-
-	// Receive the next counter value.
-	void Receive() {
-		int8_t received = 0;
-
-		if (ReadPacket(&received)) {
-			CaptureStartTime();
-
-			if (FLAGS_missed_packets_fatal) {
-				CHECK_EQ(counter_, received);
-			} else if (counter_ != received) {
-				stringstream ss;
-
-				ss << "++ERR: expected "
-					<< dec << setw(4) << setfill(' ')
-					<< static_cast<int>(counter_)
-					<< " ["
-					<< hex << setw(2) << setfill('0')
-					<< (static_cast<int>(counter_) & 0xff)
-					<< "] got "
-					<< dec << setw(4) << setfill(' ')
-					<< static_cast<int>(received)
-					<< " ["
-					<< hex << setw(2) << setfill('0')
-					<< (static_cast<int>(received) & 0xff)
-					<< "]";
-
-				LOG(ERROR) << ss.str();
-			}
-
-			// If we loose a packet we don't want to start generating
-			// errors on every subsequent packet (since the counters
-			// would then be out of sync).
-			// Instead, skip the local counter ahead to what
-			// the sending side
-			// sent so that subsequent packets are back in sync.
-			counter_ = received + 1;
-			++num_successes_;
-		}
-	}
-
-	int8_t counter() const { return counter_; }
-
-	uint64_t num_successes() const { return num_successes_; }
-
-	util::monotonic_clock::time_point start_time() const
-	{ return start_time_; }
-
-private:
-	// In case this is the first time we send or receive a packet, we want to
-	// note this as the start time. This helps the higher-level logic
-	// determine when the first packet was _actually_ sent/received.
-	void CaptureStartTime() {
-		if (num_successes_ == 0) {
-			start_time_ = util::monotonic_clock::now();
-		}
-	}
-
-	bool WritePacket(int8_t byte) const {
-		if (write(fd_, &byte, sizeof(byte)) ==
-				static_cast<ssize_t>(sizeof(byte))) {
-			return true;
-		}
-
-		return false;
-	}
-
-	bool ReadPacket(int8_t *byte) const {
-		CHECK_NOTNULL(byte);
-
-		if (read(fd_, byte, sizeof(*byte)) ==
-			static_cast<ssize_t>(sizeof(*byte))) {
-			return true;
-		}
-
-		return false;
-	}
-
-	int fd_;
-	int8_t counter_;
-	uint64_t num_successes_;
-	util::monotonic_clock::time_point start_time_;
-};
+util::stop_token exit_requested;
+util::load_generator load;
 
 speed_t ParseBaudRate(int32_t baud_rate)
 {
@@ -175,7 +144,7 @@ speed_t ParseBaudRate(int32_t baud_rate)
 void PrintResults(const char *title,
                   const util::monotonic_clock::time_point &start_time,
                   const util::monotonic_clock::time_point &end_time,
-                  const UartTester &tester)
+                  const Tester &tester)
 {
 	auto accurate_start_time = start_time;
 
@@ -195,37 +164,205 @@ void PrintResults(const char *title,
 	printf("==== %s ====\n", title);
 	printf("Elapsed time = %.6f\n", total_time);
 	printf("Num packets = %" PRIu64 "\n", tester.num_successes());
+	printf("Num errors = %" PRIu64 "\n", tester.num_errors());
+	printf("Num missed = %" PRIu64 "\n", tester.num_missed());
 	printf("Avg packets/s = %.2f\n", frames_per_sec);
 	printf("Avg us/packet = %.2f\n", avg_us_per_frame);
+	if (tester.latency().count())
+		tester.latency().print("Loopback latency");
+	tester.PrintStats();
 }
 
-void SendPacketsUntilCancelled(UartTester &tester) {
-	while (!exit_requested && tester.num_successes() < FLAGS_num_packets) {
-		tester.Send();
-	}
+void SendPacketsUntilCancelled(Tester &tester) {
+	tester.SendUntilCancelled(exit_requested, FLAGS_num_packets);
 }
 
-void ReceivePacketsUntilCancelled(UartTester &tester) {
-	while (!exit_requested && tester.num_successes() < FLAGS_num_packets) {
-		tester.Receive();
-	}
+void ReceivePacketsUntilCancelled(Tester &tester) {
+	tester.ReceiveUntilCancelled(exit_requested, FLAGS_num_packets);
+}
+
+// The tester instantiation selected by the flags.
+::std::unique_ptr<Tester> MakeTesterFromFlags(
+	int fd, const string &backend = FLAGS_backend,
+	const TesterOptions &options = TesterOptions())
+{
+	string verify = FLAGS_verify;
+
+	if (verify.empty())
+		verify = FLAGS_missed_packets_fatal ? "fatal" : "log";
+
+	return MakeTester(fd, FLAGS_payload_bits, verify, FLAGS_io, backend,
+		options);
 }
 
 static ::std::thread thread_rx;
+// Live stats for rtstat, the testers publish into it themselves.
+static util::shm_stats stats_shm;
+
+// A TX and a RX tester, with the tables their timing policies write to.
+// The testers are declared last, so they go before the tables.
+struct Testers {
+	::std::unique_ptr<TxTimestamps> sent;
+	::std::unique_ptr<TxTimestamps> arrived;
+	::std::unique_ptr<Tester> tx;
+	::std::unique_ptr<Tester> rx;
+};
+
+void PublishOptions(TesterOptions *tx, TesterOptions *rx)
+{
+	if (FLAGS_stats_shm.empty() ||
+	    (!stats_shm.valid() && !stats_shm.create(FLAGS_stats_shm, "stt")))
+		return;
+
+	tx->stats = rx->stats = &stats_shm;
+	tx->stats_name = FLAGS_port + " tx";
+	rx->stats_name = FLAGS_port + " rx";
+	tx->stats_port = stats_shm.add_port(tx->stats_name);
+	rx->stats_port = stats_shm.add_port(rx->stats_name);
+}
+
+// The testers are instantiated with what they record: --latency and
+// --one_way timing, and with publish, the --stats_shm live stats.
+Testers MakeTestersFromFlags(int tx_fd, int rx_fd,
+                             const string &backend = FLAGS_backend,
+                             bool publish = true)
+{
+	TesterOptions tx_options, rx_options;
+	Testers testers;
+
+	if (FLAGS_session && FLAGS_one_way) {
+		LOG_IF(FATAL, FLAGS_payload_bits < 16)
+			<< "--one_way needs --payload_bits of 16 or more";
+
+		testers.sent.reset(new TxTimestamps);
+		testers.arrived.reset(new TxTimestamps);
+		tx_options.timestamps = testers.sent.get();
+		rx_options.arrivals = testers.arrived.get();
+	} else if (FLAGS_latency && !FLAGS_session) {
+		LOG_IF(FATAL, FLAGS_payload_bits < 16)
+			<< "--latency needs --payload_bits of 16 or more";
+
+		testers.sent.reset(new TxTimestamps);
+		tx_options.timestamps = testers.sent.get();
+		rx_options.timestamps = testers.sent.get();
+	}
+
+	if (publish)
+		PublishOptions(&tx_options, &rx_options);
+
+	testers.tx = MakeTesterFromFlags(tx_fd, backend, tx_options);
+	testers.rx = MakeTesterFromFlags(rx_fd, backend, rx_options);
+
+	return testers;
+}
 
 // Signal handler for CTRL-C and such.
 void signal_handler(int signum)
 {
-	exit_requested = true;
+	exit_requested.request_stop();
 }
 
-int Main()
+// Replays a captured stream onto the port (or a pty pair) at its original
+// or scaled timing, with the receiving tester verifying it as usual.
+int ReplayMain()
 {
-	util::serial serial_port(FLAGS_port);
+	util::replay replay;
+	util::histogram lateness;
+
+	if (FLAGS_replay_format == "raw") {
+		if (!replay.load_raw(FLAGS_replay, FLAGS_baud_rate))
+			return 1;
+	} else if (FLAGS_replay_format == "trace") {
+		util::trace_dir dir = util::TRACE_RX;
+
+		if (FLAGS_replay_direction == "tx")
+			dir = util::TRACE_TX;
+		else if (FLAGS_replay_direction != "rx")
+			LOG(FATAL) << "Unknown replay direction: "
+				<< FLAGS_replay_direction;
+
+		if (!replay.load_trace(FLAGS_replay, dir))
+			return 1;
+	} else {
+		LOG(FATAL) << "Unknown replay format: " << FLAGS_replay_format;
+	}
+
+	CHECK_EQ(FLAGS_payload_bits, 8) << "Replayed streams are bytes";
+
+	if (replay.size() == 0)
+		LOG(FATAL) << "Nothing to replay in " << FLAGS_replay;
+	if (replay.skipped())
+		LOG(WARNING) << replay.skipped()
+			<< " block records can't be replayed, skipped";
+
+	string rx_device = FLAGS_port;
+	int master = -1;
+
+	if (FLAGS_replay_pty) {
+		master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+		PCHECK(master != -1);
+		PCHECK(grantpt(master) == 0 && unlockpt(master) == 0);
+		rx_device = ptsname(master);
+	}
+
+	util::serial serial_port(rx_device);
 	serial_port.set_speed(ParseBaudRate(FLAGS_baud_rate));
 
-	UartTester tester_tx(serial_port.fd());
-	UartTester tester_rx(serial_port.fd());
+	const int tx_fd = FLAGS_replay_pty ? master : serial_port.fd();
+
+	// A capture is replayed for the error in it, which mustn't end the
+	// run before the send time error is out.
+	if (FLAGS_verify.empty())
+		FLAGS_verify = "log";
+
+	// The capture starts midway a counter stream, sync on its first byte.
+	auto tester_rx = MakeTesterFromFlags(serial_port.fd());
+	tester_rx->set_counter(replay.bytes()[0]);
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	printf("Replaying %zu bytes (%.6f s) from %s at speed %.2f\n",
+		replay.size(), replay.duration(), FLAGS_replay.c_str(),
+		FLAGS_replay_speed);
+
+	serial_port.flush_input();
+	auto start_time = util::monotonic_clock::now();
+
+	thread_rx = ::std::thread(
+		ReceivePacketsUntilCancelled, ::std::ref(*tester_rx));
+
+	replay.run(tx_fd, FLAGS_replay_speed, &exit_requested, &lateness);
+
+	// Let the tail of the stream reach the receiver.
+	if (!FLAGS_replay_pty)
+		tcdrain(tx_fd);
+	::std::this_thread::sleep_for(::std::chrono::milliseconds(100));
+	exit_requested.request_stop();
+	thread_rx.join();
+
+	const auto end_time = util::monotonic_clock::now();
+
+	PrintResults("RX", start_time, end_time, *tester_rx);
+
+	printf("==== replay ====\n");
+	printf("Replayed bytes = %zu\n", replay.size());
+	if (FLAGS_replay_speed > 0)
+		lateness.print("Send time error");
+
+	if (master != -1)
+		close(master);
+
+	return 0;
+}
+
+// Runs the testers until the user hits CTRL-C or the requested packets
+// went through, then prints what they did.
+int RunTesters(Tester *tester_tx, Tester *tester_rx, util::serial *port)
+{
+	printf("Tester = %s\n", tester_tx->name().c_str());
+	if (!load.empty())
+		printf("Load = %s\n", load.profile().c_str());
 
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
@@ -233,34 +370,428 @@ int Main()
 	// Now that we've initialized everything, move over to realtime.
 	//util::rt_set_thread_prio_or_die(1);
 
-	serial_port.flush_input();
+	// Forked before the tester threads exist.
+	if (!load.start())
+		return 1;
+
+	util::rt_memory_report("start");
+	if (port)
+		port->flush_input();
 	auto start_time = util::monotonic_clock::now();
 
 	// Run the tester until the user hits CTRL-C or we've sent/received the
 	// maximum number of requested packets.
 	::std::thread thread_tx(
-		SendPacketsUntilCancelled, ::std::ref(tester_tx));
+		SendPacketsUntilCancelled, ::std::ref(*tester_tx));
 	thread_rx = ::std::thread(
-		ReceivePacketsUntilCancelled, ::std::ref(tester_rx));
+		ReceivePacketsUntilCancelled, ::std::ref(*tester_rx));
 
 	thread_tx.join();
 	thread_rx.join();
+	load.stop();
 
 	const auto end_time = util::monotonic_clock::now();
 
-	PrintResults("TX", start_time, end_time, tester_tx);
-	PrintResults("RX", start_time, end_time, tester_rx);
+	util::rt_memory_report("end");
+
+	PrintResults("TX", start_time, end_time, *tester_tx);
+	PrintResults("RX", start_time, end_time, *tester_rx);
+	if (!load.empty())
+		load.print();
 
 	return 0;
 }
 
+// What a phase of --load_compare is compared on.
+struct PhaseResult {
+	double tx_rate;
+	double rx_rate;
+	uint64_t errors;
+	uint64_t missed;
+	util::histogram latency;
+};
+
+// One phase of --load_compare: fresh testers for --duration, the RX one
+// kept running for --quiesce_ms after TX stopped, to drain the loop.
+PhaseResult RunPhase(int fd, util::serial *port, bool loaded)
+{
+	const Testers testers = MakeTestersFromFlags(fd, fd, FLAGS_backend,
+		false);
+	Tester *tester_tx = testers.tx.get();
+	Tester *tester_rx = testers.rx.get();
+	util::stop_token tx_stop, rx_stop;
+	PhaseResult result;
+
+	printf("==== phase: %s ====\n", loaded ? "load" : "no load");
+	if (loaded && !load.start())
+		LOG(FATAL) << "Can't start the load";
+
+	if (port)
+		port->flush_input();
+
+	const auto start_time = util::monotonic_clock::now();
+	const auto stop_time = start_time + ::std::chrono::milliseconds(
+		llround(FLAGS_duration * 1000));
+
+	::std::thread thread_tx([&] {
+		tester_tx->SendUntilCancelled(tx_stop, FLAGS_num_packets);
+	});
+	thread_rx = ::std::thread([&] {
+		tester_rx->ReceiveUntilCancelled(rx_stop, FLAGS_num_packets);
+	});
+
+	while (util::monotonic_clock::now() < stop_time &&
+	       !exit_requested.stop_requested())
+		::std::this_thread::sleep_for(::std::chrono::milliseconds(10));
+
+	tx_stop.request_stop();
+	thread_tx.join();
+
+	const auto tx_end_time = util::monotonic_clock::now();
+
+	::std::this_thread::sleep_for(
+		::std::chrono::milliseconds(FLAGS_quiesce_ms));
+	rx_stop.request_stop();
+	thread_rx.join();
+	if (loaded)
+		load.stop();
+
+	const auto end_time = util::monotonic_clock::now();
+
+	PrintResults("TX", start_time, tx_end_time, *tester_tx);
+	PrintResults("RX", start_time, end_time, *tester_rx);
+	if (loaded)
+		load.print();
+
+	result.tx_rate = tester_tx->num_successes() /
+		util::duration_in_seconds(tx_end_time - start_time);
+	result.rx_rate = tester_rx->num_successes() /
+		util::duration_in_seconds(tx_end_time - start_time);
+	result.errors = tester_rx->num_errors();
+	result.missed = tester_rx->num_missed();
+	result.latency = tester_rx->latency();
+
+	return result;
+}
+
+// The same loopback run without and with --load, one after the other.
+int CompareMain(int fd, util::serial *port)
+{
+	LOG_IF(FATAL, load.empty()) << "--load_compare needs a --load";
+	LOG_IF(FATAL, FLAGS_latency && FLAGS_payload_bits < 16)
+		<< "--latency needs --payload_bits of 16 or more";
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	auto tester = MakeTesterFromFlags(fd);
+
+	printf("Tester = %s\n", tester->name().c_str());
+	printf("Load = %s\n", load.profile().c_str());
+	tester.reset();
+
+	const PhaseResult idle = RunPhase(fd, port, false);
+
+	if (exit_requested.stop_requested())
+		return 1;
+
+	const PhaseResult loaded = RunPhase(fd, port, true);
+
+	printf("==== no load vs load ====\n");
+	printf("%-16s %14s %14s\n", "", "no load", "load");
+	printf("%-16s %14.2f %14.2f\n", "TX packets/s",
+		idle.tx_rate, loaded.tx_rate);
+	printf("%-16s %14.2f %14.2f\n", "RX packets/s",
+		idle.rx_rate, loaded.rx_rate);
+	printf("%-16s %14" PRIu64 " %14" PRIu64 "\n", "Num errors",
+		idle.errors, loaded.errors);
+	printf("%-16s %14" PRIu64 " %14" PRIu64 "\n", "Num missed",
+		idle.missed, loaded.missed);
+
+	if (idle.latency.count() && loaded.latency.count()) {
+		const double ps[] = { 50, 99, 99.9 };
+
+		for (double p : ps) {
+			char title[32];
+
+			snprintf(title, sizeof(title), "Latency p%g us", p);
+			printf("%-16s %14.2f %14.2f\n", title,
+				idle.latency.percentile(p) / 1e3,
+				loaded.latency.percentile(p) / 1e3);
+		}
+		printf("%-16s %14.2f %14.2f\n", "Latency max us",
+			idle.latency.max() / 1e3, loaded.latency.max() / 1e3);
+	}
+
+	return 0;
+}
+
+// One in 256 payload values of the last 64k: the send and arrival times
+// of both ends, the other end's moved onto the local clock.
+int PrintOneWay(util::session *session, const TxTimestamps &sent,
+                const TxTimestamps &arrived)
+{
+	const int samples = TxTimestamps::kSize / 256;
+	vector<uint64_t> mine, theirs;
+	util::histogram out, in;
+	uint64_t dropped = 0;
+
+	for (int i = 0; i < samples; ++i)
+		mine.push_back(sent.When(i * 256));
+	for (int i = 0; i < samples; ++i)
+		mine.push_back(arrived.When(i * 256));
+
+	if (!session->exchange_values(mine, &theirs))
+		return 1;
+
+	// An arrival before the send is an older payload of the same
+	// value, or an offset off by more than its bound.
+	auto add = [&](util::histogram *h, uint64_t from, uint64_t to) {
+		if (to >= from)
+			h->add(to - from);
+		else
+			++dropped;
+	};
+
+	for (int i = 0; i < samples; ++i) {
+		if (mine[i] && theirs[samples + i])
+			add(&out, mine[i],
+				session->to_local(theirs[samples + i]));
+		if (theirs[i] && mine[samples + i])
+			add(&in, session->to_local(theirs[i]),
+				mine[samples + i]);
+	}
+
+	session->print_clock();
+	out.print("One-way here -> there");
+	in.print("One-way there -> here");
+	if (dropped)
+		printf("Samples dropped = %" PRIu64 "\n", dropped);
+
+	return 0;
+}
+
+// Both ends run with --session: they agree on the config over the link
+// and start together, send for --duration, keep receiving for
+// --quiesce_ms and exchange their counters, so loss and throughput come
+// out end to end for both directions, free of the startup skew.
+int RunSession(const Testers &testers, int fd, util::serial *port)
+{
+	Tester *tester_tx = testers.tx.get();
+	Tester *tester_rx = testers.rx.get();
+	util::session_config config;
+	util::stop_token tx_stop, rx_stop;
+
+	config.baud = FLAGS_baud_rate;
+	config.payload_bits = FLAGS_payload_bits;
+	config.duration_ms = llround(FLAGS_duration * 1000);
+
+	util::session session(fd, config);
+
+	printf("Tester = %s\n", tester_tx->name().c_str());
+
+	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+
+	if (port)
+		port->flush_input();
+
+	printf("Waiting for the other end ...\n");
+	fflush(stdout);
+
+	if (!session.start())
+		return 1;
+	if (FLAGS_one_way && !session.probe_clock())
+		return 1;
+
+	printf("Session started, %s\n",
+		session.leader() ? "leading" : "following");
+	if (!load.empty())
+		printf("Load = %s\n", load.profile().c_str());
+
+	// Forked before the tester threads exist.
+	if (!load.start())
+		return 1;
+
+	util::rt_memory_report("start");
+	const auto start_time = util::monotonic_clock::now();
+	const auto stop_time = start_time +
+		::std::chrono::milliseconds(config.duration_ms);
+
+	::std::thread thread_tx([&] {
+		tester_tx->SendUntilCancelled(tx_stop, FLAGS_num_packets);
+	});
+	thread_rx = ::std::thread([&] {
+		tester_rx->ReceiveUntilCancelled(rx_stop, FLAGS_num_packets);
+	});
+
+	while (util::monotonic_clock::now() < stop_time &&
+	       !exit_requested.stop_requested())
+		::std::this_thread::sleep_for(::std::chrono::milliseconds(10));
+
+	tx_stop.request_stop();
+	thread_tx.join();
+
+	const auto tx_end_time = util::monotonic_clock::now();
+
+	// Not a tty for network backends, nothing to wait for then.
+	tcdrain(fd);
+	::std::this_thread::sleep_for(
+		::std::chrono::milliseconds(FLAGS_quiesce_ms));
+	rx_stop.request_stop();
+	thread_rx.join();
+	load.stop();
+
+	const auto end_time = util::monotonic_clock::now();
+
+	util::rt_memory_report("end");
+
+	PrintResults("TX", start_time, tx_end_time, *tester_tx);
+	PrintResults("RX", start_time, end_time, *tester_rx);
+	if (!load.empty())
+		load.print();
+
+	util::session_stats local;
+	auto tx_start = start_time;
+
+	if (tester_tx->num_successes() > 0)
+		tx_start = tester_tx->start_time();
+
+	local.tx_packets = tester_tx->num_successes();
+	local.rx_packets = tester_rx->num_successes();
+	local.rx_errors = tester_rx->num_errors();
+	local.rx_missed = tester_rx->num_missed();
+	local.tx_ns = ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+		tx_end_time - tx_start).count();
+	local.rx_ns = ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+		end_time - start_time).count();
+
+	// The second cluster of probes gives the drift over the run.
+	if (FLAGS_one_way && !session.probe_clock())
+		return 1;
+	if (!session.exchange(local))
+		return 1;
+
+	util::session::print(local, session.peer());
+
+	if (FLAGS_one_way)
+		return PrintOneWay(&session, *testers.sent, *testers.arrived);
+
+	return 0;
+}
+
+// The same counter stream in CAN frames, on interface --port. A raw
+// socket only sees what other sockets send, so TX and RX get one each.
+int CanMain()
+{
+	const int rx_id = FLAGS_can_rx_id < 0 ? FLAGS_can_id : FLAGS_can_rx_id;
+	const int tx_fd = util::can_open(FLAGS_port, -1);
+	const int rx_fd = util::can_open(FLAGS_port, rx_id);
+
+	CHECK(tx_fd != -1 && rx_fd != -1)
+		<< "Can't open CAN interface " << FLAGS_port;
+	LOG_IF(FATAL, FLAGS_session)
+		<< "--session needs a byte stream, CAN frames are not one";
+
+	const string backend = "can=" + ::std::to_string(FLAGS_can_id);
+	Testers testers = MakeTestersFromFlags(tx_fd, rx_fd, backend);
+
+	const int ret = RunTesters(testers.tx.get(), testers.rx.get(), 0);
+
+	testers.tx.reset();
+	testers.rx.reset();
+	close(tx_fd);
+	close(rx_fd);
+
+	return ret;
+}
+
+// A port behind a device server, --port being its host:port. TCP is full
+// duplex, TX and RX share the connection. RFC2217 sets the remote baud
+// rate first, as set_speed() would on a local port.
+int NetMain()
+{
+	// Control frames go out as raw bytes, a device server would take their
+	// 0xff bytes for telnet commands.
+	LOG_IF(FATAL, FLAGS_session && FLAGS_backend == "rfc2217")
+		<< "--session doesn't escape telnet, use --backend=tcp";
+
+	const int fd = util::tcp_connect(FLAGS_port);
+
+	CHECK(fd != -1) << "Can't connect to " << FLAGS_port;
+
+	if (FLAGS_backend == "rfc2217") {
+		util::tcp_backend control(fd, true);
+
+		CHECK(control.negotiate(FLAGS_baud_rate))
+			<< "RFC2217 negotiation with " << FLAGS_port << " failed";
+		printf("Remote baud rate = %u\n", control.remote_baud());
+	}
+
+	if (FLAGS_load_compare) {
+		const int ret = CompareMain(fd, 0);
+
+		close(fd);
+		return ret;
+	}
+
+	Testers testers = MakeTestersFromFlags(fd, fd);
+
+	const int ret = FLAGS_session ?
+		RunSession(testers, fd, 0) :
+		RunTesters(testers.tx.get(), testers.rx.get(), 0);
+
+	testers.tx.reset();
+	testers.rx.reset();
+	close(fd);
+
+	return ret;
+}
+
+int Main()
+{
+	if (FLAGS_backend == "can")
+		return CanMain();
+	if (FLAGS_backend.compare(0, 3, "tcp") == 0 ||
+	    FLAGS_backend == "rfc2217")
+		return NetMain();
+
+	util::serial serial_port(FLAGS_port);
+	serial_port.set_speed(ParseBaudRate(FLAGS_baud_rate));
+
+	if (FLAGS_load_compare)
+		return CompareMain(serial_port.fd(), &serial_port);
+
+	const Testers testers = MakeTestersFromFlags(serial_port.fd(),
+		serial_port.fd());
+
+	if (FLAGS_session)
+		return RunSession(testers, serial_port.fd(), &serial_port);
+
+	return RunTesters(testers.tx.get(), testers.rx.get(), &serial_port);
+}
+
 }  // namespace peloton
 
 int main(int argc, char *argv[])
 {
 	::gflags::SetUsageMessage(::peloton::usage);
 	util::init(&argc, &argv);
-	util::rt_init();
+
+	LOG_IF(FATAL, FLAGS_rt_memory != "all" && FLAGS_rt_memory != "budget")
+		<< "--rt_memory is all or budget";
+	// The testers' writes stay far below the MSG_ZEROCOPY threshold and
+	// refill their buffers right away, bench_backends covers it instead.
+	LOG_IF(FATAL, FLAGS_backend == "tcp-zerocopy")
+		<< "--backend=tcp-zerocopy is for bench_backends only";
+	util::rt_init(FLAGS_rt_memory == "budget" ?
+		util::RT_MEMORY_BUDGET : util::RT_MEMORY_ALL);
+
+	if (!FLAGS_load.empty() && !::peloton::load.parse(FLAGS_load))
+		return 1;
+
+	if (!FLAGS_replay.empty())
+		return ::peloton::ReplayMain();
 
 	return ::peloton::Main();
 }
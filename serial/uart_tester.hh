@@ -0,0 +1,736 @@
+/*
+ * Counter stream tester, configured at compile time.
+ *
+ * A UartTester is instantiated over the payload (an 8 to 64 bit counter),
+ * a verification policy (what to do with an out of sequence payload), an
+ * I/O strategy (how payload bytes get to and from the fd), a timing policy
+ * (send and arrival times) and a publishing policy (live stats), so that
+ * the send and receive loops carry no runtime flag checks. MakeTester()
+ * picks the instantiation at startup.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#ifndef __uart_tester_hh
+#define __uart_tester_hh
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "glog/logging.h"
+
+#include "cacheline.hh"
+#include "clock.hh"
+#include "realtime.hh"
+#include "serial_io.hh"
+#include "shmstats.hh"
+#include "stats.hh"
+
+namespace peloton {
+
+namespace util = ::nomovok::util;
+
+// "expected N [hex] got M [hex]", as the receiver always logged it.
+template <typename Payload>
+::std::string FormatMismatch(Payload expected, Payload received)
+{
+	// Promote, an int8_t would be printed as a character.
+	typedef typename ::std::conditional<::std::is_signed<Payload>::value,
+		int64_t, uint64_t>::type Wide;
+	typedef typename ::std::make_unsigned<Payload>::type Bits;
+	const int digits = 2 * sizeof(Payload);
+	::std::stringstream ss;
+
+	ss << "expected "
+		<< ::std::dec << ::std::setw(4) << ::std::setfill(' ')
+		<< static_cast<Wide>(expected)
+		<< " ["
+		<< ::std::hex << ::std::setw(digits) << ::std::setfill('0')
+		<< static_cast<uint64_t>(static_cast<Bits>(expected))
+		<< "] got "
+		<< ::std::dec << ::std::setw(4) << ::std::setfill(' ')
+		<< static_cast<Wide>(received)
+		<< " ["
+		<< ::std::hex << ::std::setw(digits) << ::std::setfill('0')
+		<< static_cast<uint64_t>(static_cast<Bits>(received))
+		<< "]";
+
+	return ss.str();
+}
+
+// Verification policies: what Receive() does on an out of sequence
+// payload, besides counting it.
+
+struct FatalVerify {
+	static const char *Name() { return "fatal"; }
+
+	template <typename Payload>
+	static void Mismatch(Payload expected, Payload received)
+	{ LOG(FATAL) << "++ERR: " << FormatMismatch(expected, received); }
+};
+
+struct LogVerify {
+	static const char *Name() { return "log"; }
+
+	template <typename Payload>
+	static void Mismatch(Payload expected, Payload received)
+	{ LOG(ERROR) << "++ERR: " << FormatMismatch(expected, received); }
+};
+
+struct CountVerify {
+	static const char *Name() { return "count"; }
+
+	template <typename Payload>
+	static void Mismatch(Payload, Payload) {}
+};
+
+// I/O strategies: move up to kBatch payloads per syscall. The buffer
+// handed in can start or end midway a payload of unit bytes, after a
+// partial read or write.
+
+struct SingleIO {
+	enum { kBatch = 1 };
+	static const char *Name() { return "single"; }
+	static void PrintStats() {}
+
+	static ssize_t Write(int fd, const uint8_t *p, size_t len, size_t)
+	{ return write(fd, p, len); }
+	static ssize_t Read(int fd, uint8_t *p, size_t len, size_t)
+	{ return read(fd, p, len); }
+};
+
+struct BatchedIO {
+	enum { kBatch = 64 };
+	static const char *Name() { return "batched"; }
+	static void PrintStats() {}
+
+	static ssize_t Write(int fd, const uint8_t *p, size_t len, size_t)
+	{ return write(fd, p, len); }
+	static ssize_t Read(int fd, uint8_t *p, size_t len, size_t)
+	{ return read(fd, p, len); }
+};
+
+// A iovec per payload, as if every payload lived in a frame of its own.
+struct VectoredIO {
+	enum { kBatch = 64 };
+	static const char *Name() { return "vectored"; }
+	static void PrintStats() {}
+
+	static ssize_t Write(int fd, const uint8_t *p, size_t len, size_t unit)
+	{
+		struct iovec iov[kBatch];
+
+		return writev(fd, iov, Scatter(iov, (uint8_t *)p, len, unit));
+	}
+
+	static ssize_t Read(int fd, uint8_t *p, size_t len, size_t unit)
+	{
+		struct iovec iov[kBatch];
+
+		return readv(fd, iov, Scatter(iov, p, len, unit));
+	}
+
+private:
+	static int Scatter(struct iovec *iov, uint8_t *p, size_t len,
+			   size_t unit)
+	{
+		int n = 0;
+
+		while (len && n < kBatch) {
+			const size_t chunk = len < unit ? len : unit;
+
+			iov[n].iov_base = p;
+			iov[n].iov_len = chunk;
+			p += chunk;
+			len -= chunk;
+			n++;
+		}
+
+		return n;
+	}
+};
+
+// Moves batches through a util::serial_backend (epoll, io_uring, ...),
+// which owns its own view of the fd.
+struct BackendIO {
+	enum { kBatch = 64 };
+
+	explicit BackendIO(util::serial_backend *b) : backend(b) {}
+
+	const char *Name() const { return backend->name(); }
+	void PrintStats() const { backend->print_stats(); }
+
+	ssize_t Write(int, const uint8_t *p, size_t len, size_t)
+	{ return backend->write(p, len); }
+	ssize_t Read(int, uint8_t *p, size_t len, size_t)
+	{ return backend->read(p, len); }
+
+	::std::unique_ptr<util::serial_backend> backend;
+};
+
+// When the tester's TX is looped back to its own RX: the send time of
+// the last 64k payloads, by value, so the receiver gets the round trip of
+// each payload. Needs payloads of 16 bits or more, 8 bit ones would alias
+// with a tty buffer's worth in flight. The same table keeps arrival times
+// of a receiver, for one-way latency against the other end's send times.
+struct TxTimestamps {
+	enum { kSize = 1 << 16 };
+
+	::std::atomic<uint64_t> ns[kSize];
+
+	TxTimestamps() { for (auto &t : ns) t.store(0); }
+
+	// Half a megabyte written from the loops, locked and faulted in
+	// up front in any rt_init() mode.
+	static void *operator new(size_t size)
+	{
+		void *p = util::rt_alloc(size);
+
+		CHECK(p != nullptr);
+		return p;
+	}
+
+	static void operator delete(void *p, size_t size)
+	{ util::rt_free(p, size); }
+
+	void Stamp(uint64_t value, uint64_t when)
+	{ ns[value & (kSize - 1)].store(when, ::std::memory_order_relaxed); }
+	uint64_t When(uint64_t value) const
+	{ return ns[value & (kSize - 1)].load(::std::memory_order_relaxed); }
+};
+
+// Timing policies: what the loops do with the clock. kClock says whether
+// they read it at all. Sent() gets every payload the driver accepted,
+// Received() every payload read, with the time of their batch.
+
+struct NoTiming {
+	enum { kClock = 0 };
+
+	void Sent(uint64_t, uint64_t) {}
+	void Received(uint64_t, uint64_t, util::histogram *) {}
+};
+
+// Loopback: the TX and RX testers share the table, the receiver gets the
+// round trip of each payload.
+struct LatencyTiming {
+	enum { kClock = 1 };
+
+	explicit LatencyTiming(TxTimestamps *t) : table(t) {}
+
+	void Sent(uint64_t value, uint64_t now) { table->Stamp(value, now); }
+	void Received(uint64_t value, uint64_t now, util::histogram *latency)
+	{
+		const uint64_t sent = table->When(value);
+
+		if (sent && sent <= now)
+			latency->add(now - sent);
+	}
+
+	TxTimestamps *table;
+};
+
+// One-way: send or arrival times into a table of the tester's own, for
+// the other end to compare against.
+struct ArrivalTiming {
+	enum { kClock = 1 };
+
+	explicit ArrivalTiming(TxTimestamps *t) : table(t) {}
+
+	void Sent(uint64_t value, uint64_t now) { table->Stamp(value, now); }
+	void Received(uint64_t value, uint64_t now, util::histogram *)
+	{ table->Stamp(value, now); }
+
+	TxTimestamps *table;
+};
+
+// Publishing policies: live stats for rtstat. The loop asks Due() every
+// round and hands its counters to Publish() when it says so, and once
+// more when it stops.
+
+struct NoPublish {
+	bool Due() { return false; }
+	void Publish(bool, const char *, uint64_t, uint64_t, uint64_t,
+		     const util::histogram &) {}
+};
+
+// Into the slot port of stats, from the loop's own thread, the only one
+// writing it. Every 100 ms, the clock is only looked at every
+// kPublishCheck rounds of the loop.
+struct ShmPublish {
+	enum { kPublishCheck = 256 };
+	static const uint64_t kPublishNs = 100000000;
+
+	ShmPublish(util::shm_stats *s, int p, const ::std::string &name) :
+	stats(s),
+	port(p),
+	rounds(0),
+	published()
+	{
+		strncpy(published.name, name.c_str(),
+			sizeof(published.name) - 1);
+	}
+
+	bool Due()
+	{
+		if (++rounds % kPublishCheck)
+			return false;
+
+		const uint64_t now = util::monotonic_clock::now()
+			.time_since_epoch().count();
+
+		return now - published.updated_ns >= kPublishNs;
+	}
+
+	// The RX counters are left alone by a TX tester, and the other way.
+	void Publish(bool tx, const char *state, uint64_t packets,
+		     uint64_t errors, uint64_t missed,
+		     const util::histogram &latency)
+	{
+		strncpy(published.state, state, sizeof(published.state) - 1);
+		if (tx) {
+			published.tx_packets = packets;
+		} else {
+			published.rx_packets = packets;
+			published.rx_errors = errors;
+			published.rx_missed = missed;
+		}
+		published.latency = latency;
+		published.updated_ns = util::monotonic_clock::now()
+			.time_since_epoch().count();
+		stats->publish(port, published);
+	}
+
+	util::shm_stats *stats;
+	int port;
+	uint64_t rounds;
+	// What goes out to the stats slot, built in place.
+	util::shm_port published;
+};
+
+// What a tester records besides its counters. Fixed when it is made, it
+// picks the timing and publishing policies.
+struct TesterOptions {
+	// Send times, and on receive the latency() against them.
+	TxTimestamps *timestamps;
+	// Send or arrival times, for the other end of a session.
+	TxTimestamps *arrivals;
+	// Live stats for rtstat, into slot stats_port.
+	util::shm_stats *stats;
+	int stats_port;
+	::std::string stats_name;
+
+	TesterOptions() :
+	timestamps(0),
+	arrivals(0),
+	stats(0),
+	stats_port(-1)
+	{}
+};
+
+// Runtime face of the testers. Only the loops are virtual, the per
+// payload work is inlined into them.
+class Tester
+{
+public:
+	// Stack the loops fault in, and lock in budget mode, before
+	// running. Well over what Send() and Receive() go through.
+	enum { kStackPrefault = 32 * 1024 };
+
+	virtual ~Tester() {}
+
+	// Send/receive until a stop is requested or num_packets payloads
+	// went through.
+	virtual void SendUntilCancelled(const util::stop_token &stop,
+					uint64_t num_packets) = 0;
+	virtual void ReceiveUntilCancelled(const util::stop_token &stop,
+					   uint64_t num_packets) = 0;
+
+	// Sets the next expected/sent value, i.e. to join a stream midway.
+	virtual void set_counter(uint64_t counter) = 0;
+
+	virtual uint64_t num_successes() const = 0;
+	// Out of sequence payloads received, and how many were skipped
+	// by forward jumps of the sequence.
+	virtual uint64_t num_errors() const = 0;
+	virtual uint64_t num_missed() const = 0;
+	virtual util::monotonic_clock::time_point start_time() const = 0;
+	virtual ::std::string name() const = 0;
+
+	// Round trips, with TesterOptions::timestamps shared by the TX and
+	// RX testers of a loopback.
+	virtual const util::histogram &latency() const = 0;
+	// I/O backend counters, if it keeps any.
+	virtual void PrintStats() const = 0;
+
+	// Testers carry cache line aligned state, plain new doesn't honour
+	// that before C++17. rt_alloc() pages are aligned, and locked
+	// when rt_init() doesn't lock everything.
+	static void *operator new(size_t size)
+	{
+		void *p = util::rt_alloc(size);
+
+		CHECK(p != nullptr);
+		return p;
+	}
+
+	static void operator delete(void *p, size_t size)
+	{ util::rt_free(p, size); }
+};
+
+// Helper class to take care of actually sending counter payloads and
+// receiving them. On one side of the link, call the `Send` function in a
+// loop and on the other call the `Receive` function in a loop.
+template <typename Payload, typename Verify, typename IO,
+	  typename Timing = NoTiming, typename Publisher = NoPublish>
+class UartTester : public Tester
+{
+public:
+	explicit UartTester(int fd, IO io = IO(), Timing timing = Timing(),
+			    Publisher publish = Publisher()) noexcept :
+	fd_(fd),
+	io_(::std::move(io)),
+	timing_(timing),
+	publish_(::std::move(publish))
+	{
+		counters_.counter = 0;
+		counters_.num_successes = 0;
+		counters_.num_errors = 0;
+		counters_.num_missed = 0;
+		counters_.start_time = util::monotonic_clock::min_time;
+		counters_.tx_off = 0;
+		counters_.tx_len = 0;
+		counters_.rx_len = 0;
+	}
+
+	// Send the next batch of incrementing counter values, at most max
+	// of them.
+	void Send(uint64_t max) {
+		Counters &c = counters_;
+
+		if (c.tx_off == c.tx_len) {
+			const size_t batch = IO::kBatch;
+			const size_t n = max < batch ? max : batch;
+
+			for (size_t i = 0; i < n; ++i)
+				tx_buf_[i] = c.counter++;
+			c.tx_off = 0;
+			c.tx_len = n * sizeof(Payload);
+		}
+
+		const ssize_t n = io_.Write(fd_, bytes(tx_buf_) + c.tx_off,
+			c.tx_len - c.tx_off, sizeof(Payload));
+
+		if (n > 0) {
+			const size_t done = c.tx_off / sizeof(Payload);
+
+			CaptureStartTime();
+			c.tx_off += n;
+			c.num_successes += c.tx_off / sizeof(Payload) - done;
+
+			if (Timing::kClock)
+				Stamp(done, c.tx_off / sizeof(Payload));
+		}
+	}
+
+	// Receive and check whatever counter values are available.
+	void Receive() {
+		Counters &c = counters_;
+		uint8_t *buf = bytes(rx_buf_);
+		const ssize_t n = io_.Read(fd_, buf + c.rx_len,
+			sizeof(rx_buf_) - c.rx_len, sizeof(Payload));
+
+		if (n <= 0)
+			return;
+
+		CaptureStartTime();
+		c.rx_len += n;
+
+		const size_t count = c.rx_len / sizeof(Payload);
+		const uint64_t now = Timing::kClock ? Now() : 0;
+
+		for (size_t i = 0; i < count; ++i) {
+			Payload received;
+
+			memcpy(&received, buf + i * sizeof(Payload),
+				sizeof(Payload));
+			Check(received);
+			timing_.Received(static_cast<Bits>(received), now,
+				&latency_);
+		}
+
+		// Keep the head of a payload that has been split.
+		const size_t used = count * sizeof(Payload);
+
+		if (used < c.rx_len)
+			memmove(buf, buf + used, c.rx_len - used);
+		c.rx_len -= used;
+	}
+
+	void SendUntilCancelled(const util::stop_token &stop,
+				uint64_t num_packets) override {
+		util::rt_stack_prefault(kStackPrefault);
+		while (!stop.stop_requested() &&
+		       counters_.num_successes < num_packets) {
+			Send(num_packets - counters_.num_successes);
+			MaybePublish(true);
+		}
+		Publish(true, "stopped");
+	}
+
+	void ReceiveUntilCancelled(const util::stop_token &stop,
+				   uint64_t num_packets) override {
+		util::rt_stack_prefault(kStackPrefault);
+		while (!stop.stop_requested() &&
+		       counters_.num_successes < num_packets) {
+			Receive();
+			MaybePublish(false);
+		}
+		Publish(false, "stopped");
+	}
+
+	void set_counter(uint64_t counter) override
+	{ counters_.counter = static_cast<Payload>(counter); }
+
+	uint64_t num_successes() const override
+	{ return counters_.num_successes; }
+	uint64_t num_errors() const override { return counters_.num_errors; }
+	uint64_t num_missed() const override { return counters_.num_missed; }
+
+	util::monotonic_clock::time_point start_time() const override
+	{ return counters_.start_time; }
+
+	::std::string name() const override {
+		::std::stringstream ss;
+
+		ss << 8 * sizeof(Payload) << "bit/" << Verify::Name() << "/"
+			<< io_.Name();
+		return ss.str();
+	}
+
+	const util::histogram &latency() const override { return latency_; }
+	void PrintStats() const override { io_.PrintStats(); }
+
+private:
+	void MaybePublish(bool tx) {
+		if (publish_.Due())
+			Publish(tx, "running");
+	}
+
+	void Publish(bool tx, const char *state) {
+		publish_.Publish(tx, state, counters_.num_successes,
+			counters_.num_errors, counters_.num_missed, latency_);
+	}
+
+	typedef typename ::std::make_unsigned<Payload>::type Bits;
+
+	static uint8_t *bytes(Payload *p) { return (uint8_t *)p; }
+
+	static uint64_t Now() {
+		return util::monotonic_clock::now().time_since_epoch().count();
+	}
+
+	// Payloads [from, to) of the current batch have just been accepted
+	// by the driver.
+	void Stamp(size_t from, size_t to) {
+		const uint64_t now = Now();
+
+		for (size_t i = from; i < to; ++i)
+			timing_.Sent(static_cast<Bits>(tx_buf_[i]), now);
+	}
+
+	void Check(Payload received) {
+		if (received != counters_.counter) {
+			Verify::Mismatch(counters_.counter, received);
+			++counters_.num_errors;
+
+			// A forward jump is lost payloads, anything else is
+			// a corrupted or repeated one.
+			const Bits gap = received - counters_.counter;
+
+			if (gap < static_cast<Bits>(~Bits(0)) / 2)
+				counters_.num_missed += gap;
+		}
+
+		// If we loose a packet we don't want to start generating
+		// errors on every subsequent packet (since the counters
+		// would then be out of sync).
+		// Instead, skip the local counter ahead to what
+		// the sending side
+		// sent so that subsequent packets are back in sync.
+		counters_.counter = received + 1;
+		++counters_.num_successes;
+	}
+
+	// In case this is the first time we send or receive a packet, we want to
+	// note this as the start time. This helps the higher-level logic
+	// determine when the first packet was _actually_ sent/received.
+	void CaptureStartTime() {
+		if (counters_.num_successes == 0) {
+			counters_.start_time = util::monotonic_clock::now();
+		}
+	}
+
+	const int fd_;
+	IO io_;
+	Timing timing_;
+	Publisher publish_;
+	// Written per packet with a timing policy only, far bigger than a
+	// cache line anyway.
+	util::histogram latency_;
+
+	// The counters and buffer offsets written per packet, on a cache
+	// line of their own: the TX and RX testers are driven by threads on
+	// different cores and would otherwise bounce a shared line on every
+	// byte.
+	struct alignas(util::cache_line_size) Counters {
+		Payload counter;
+		uint64_t num_successes;
+		uint64_t num_errors;
+		uint64_t num_missed;
+		util::monotonic_clock::time_point start_time;
+		size_t tx_off;
+		size_t tx_len;
+		size_t rx_len;
+	} counters_;
+
+	Payload tx_buf_[IO::kBatch];
+	Payload rx_buf_[IO::kBatch];
+};
+
+template <typename Payload, typename Verify, typename Timing,
+	  typename Publisher>
+Tester *MakeTesterWithPolicies(int fd, const ::std::string &io,
+			       const ::std::string &backend,
+			       const Timing &timing, const Publisher &publish)
+{
+	if (backend != "plain") {
+		LOG_IF(FATAL, io != "batched")
+			<< "The " << backend << " backend only moves batches";
+
+		util::serial_backend *b = util::make_serial_backend(backend, fd);
+
+		CHECK(b) << "Can't set up the " << backend << " backend";
+
+		return new UartTester<Payload, Verify, BackendIO, Timing,
+			Publisher>(fd, BackendIO(b), timing, publish);
+	}
+
+	if (io == "single")
+		return new UartTester<Payload, Verify, SingleIO, Timing,
+			Publisher>(fd, SingleIO(), timing, publish);
+	if (io == "batched")
+		return new UartTester<Payload, Verify, BatchedIO, Timing,
+			Publisher>(fd, BatchedIO(), timing, publish);
+	if (io == "vectored")
+		return new UartTester<Payload, Verify, VectoredIO, Timing,
+			Publisher>(fd, VectoredIO(), timing, publish);
+
+	LOG(FATAL) << "Unknown I/O strategy: " << io;
+	return 0;
+}
+
+template <typename Payload, typename Verify, typename Timing>
+Tester *MakeTesterWithTiming(int fd, const ::std::string &io,
+			     const ::std::string &backend,
+			     const Timing &timing,
+			     const TesterOptions &options)
+{
+	if (options.stats)
+		return MakeTesterWithPolicies<Payload, Verify>(fd, io, backend,
+			timing, ShmPublish(options.stats, options.stats_port,
+				options.stats_name));
+
+	return MakeTesterWithPolicies<Payload, Verify>(fd, io, backend,
+		timing, NoPublish());
+}
+
+template <typename Payload, typename Verify>
+Tester *MakeTesterWithVerify(int fd, const ::std::string &io,
+			     const ::std::string &backend,
+			     const TesterOptions &options)
+{
+	LOG_IF(FATAL, options.timestamps && options.arrivals)
+		<< "A tester keeps either timestamps or arrivals";
+
+	if (options.timestamps)
+		return MakeTesterWithTiming<Payload, Verify>(fd, io, backend,
+			LatencyTiming(options.timestamps), options);
+	if (options.arrivals)
+		return MakeTesterWithTiming<Payload, Verify>(fd, io, backend,
+			ArrivalTiming(options.arrivals), options);
+
+	return MakeTesterWithTiming<Payload, Verify>(fd, io, backend,
+		NoTiming(), options);
+}
+
+template <typename Payload>
+Tester *MakeTesterWithPayload(int fd, const ::std::string &verify,
+			      const ::std::string &io,
+			      const ::std::string &backend,
+			      const TesterOptions &options)
+{
+	if (verify == "fatal")
+		return MakeTesterWithVerify<Payload, FatalVerify>(fd, io,
+			backend, options);
+	if (verify == "log")
+		return MakeTesterWithVerify<Payload, LogVerify>(fd, io,
+			backend, options);
+	if (verify == "count")
+		return MakeTesterWithVerify<Payload, CountVerify>(fd, io,
+			backend, options);
+
+	LOG(FATAL) << "Unknown verification policy: " << verify;
+	return 0;
+}
+
+// Picks the tester instantiation for the given payload width in bits,
+// verification policy (fatal, log, count), I/O strategy (single,
+// batched, vectored) and options. Backends other than plain (see
+// util::make_serial_backend()) take the batched strategy.
+inline ::std::unique_ptr<Tester> MakeTester(int fd, int payload_bits,
+					    const ::std::string &verify,
+					    const ::std::string &io,
+					    const ::std::string &backend = "plain",
+					    const TesterOptions &options =
+						TesterOptions())
+{
+	Tester *tester = 0;
+
+	switch (payload_bits) {
+	case 8:
+		tester = MakeTesterWithPayload<int8_t>(fd, verify, io,
+							      backend, options);
+	break;
+	case 16:
+		tester = MakeTesterWithPayload<uint16_t>(fd, verify, io,
+								backend, options);
+	break;
+	case 32:
+		tester = MakeTesterWithPayload<uint32_t>(fd, verify, io,
+								backend, options);
+	break;
+	case 64:
+		tester = MakeTesterWithPayload<uint64_t>(fd, verify, io,
+								backend, options);
+	break;
+	default:
+		LOG(FATAL) << "Unsupported payload width: " << payload_bits;
+	}
+
+	return ::std::unique_ptr<Tester>(tester);
+}
+
+}  // namespace peloton
+
+#endif // __uart_tester_hh
@@ -0,0 +1,269 @@
+/*
+ * tce - serial device server stand-in
+ *
+ * Echoes back whatever a client sends, like a serial port with a loopback
+ * plug behind a device server, so stt --backend=tcp or rfc2217 can be
+ * run against localhost. In RFC2217 mode the telnet option negotiation is
+ * answered and the COM port commands (SET-BAUDRATE ...) acknowledged as a
+ * real server would, data is echoed with its 0xff escaping intact.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+enum {
+	TN_SE = 240,
+	TN_SB = 250,
+	TN_WILL = 251,
+	TN_WONT = 252,
+	TN_DO = 253,
+	TN_DONT = 254,
+	TN_IAC = 255,
+};
+
+enum {
+	TN_OPT_BINARY = 0,
+	TN_OPT_SGA = 3,
+	TN_OPT_COM_PORT = 44,
+};
+
+static bool rfc2217;
+
+static bool write_all(int fd, const uint8_t *p, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, p, len);
+
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+/*
+ * Telnet side of a client: data goes back as it came, escaped, commands
+ * get their answer appended to out instead.
+ */
+struct telnet_echo {
+	enum { DATA, IAC, VERB, SB, SB_IAC } state = DATA;
+	uint8_t verb = 0;
+	vector<uint8_t> sb;
+	bool answered[256] = {};
+
+	void option(uint8_t opt, vector<uint8_t> *out)
+	{
+		const bool ok = opt == TN_OPT_BINARY || opt == TN_OPT_SGA ||
+			opt == TN_OPT_COM_PORT;
+		uint8_t answer;
+
+		if (answered[opt])
+			return;
+
+		if (verb == TN_DO)
+			answer = ok ? TN_WILL : TN_WONT;
+		else if (verb == TN_WILL)
+			answer = ok ? TN_DO : TN_DONT;
+		else
+			return;
+
+		answered[opt] = true;
+		out->insert(out->end(), { TN_IAC, answer, opt });
+	}
+
+	/* COM port commands are acknowledged as command + 100, same value */
+	void subnegotiation(vector<uint8_t> *out)
+	{
+		if (sb.size() < 2 || sb[0] != TN_OPT_COM_PORT)
+			return;
+
+		if (sb[1] == 1 && sb.size() >= 6) {
+			printf("client set baud rate %u\n",
+				(unsigned)sb[2] << 24 | sb[3] << 16 |
+				sb[4] << 8 | sb[5]);
+			fflush(stdout);
+		}
+
+		out->insert(out->end(), { TN_IAC, TN_SB, TN_OPT_COM_PORT,
+			(uint8_t)(sb[1] + 100) });
+		for (size_t i = 2; i < sb.size(); ++i) {
+			out->push_back(sb[i]);
+			if (sb[i] == TN_IAC)
+				out->push_back(TN_IAC);
+		}
+		out->insert(out->end(), { TN_IAC, TN_SE });
+	}
+
+	void feed(const uint8_t *p, size_t len, vector<uint8_t> *out)
+	{
+		for (size_t i = 0; i < len; ++i) {
+			const uint8_t c = p[i];
+
+			switch (state) {
+			case DATA:
+				if (c == TN_IAC)
+					state = IAC;
+				else
+					out->push_back(c);
+				break;
+			case IAC:
+				if (c == TN_IAC) {
+					out->insert(out->end(), { TN_IAC, TN_IAC });
+					state = DATA;
+				} else if (c >= TN_WILL && c <= TN_DONT) {
+					verb = c;
+					state = VERB;
+				} else if (c == TN_SB) {
+					sb.clear();
+					state = SB;
+				} else {
+					state = DATA;
+				}
+				break;
+			case VERB:
+				option(c, out);
+				state = DATA;
+				break;
+			case SB:
+				if (c == TN_IAC)
+					state = SB_IAC;
+				else if (sb.size() < 64)
+					sb.push_back(c);
+				break;
+			case SB_IAC:
+				if (c == TN_IAC) {
+					sb.push_back(c);
+					state = SB;
+				} else {
+					if (c == TN_SE)
+						subnegotiation(out);
+					state = DATA;
+				}
+				break;
+			}
+		}
+	}
+};
+
+static void serve(int fd)
+{
+	telnet_echo telnet;
+	vector<uint8_t> out;
+	uint8_t buf[65536];
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	for (;;) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (!rfc2217) {
+			if (!write_all(fd, buf, n))
+				break;
+			continue;
+		}
+
+		out.clear();
+		telnet.feed(buf, n, &out);
+		if (!out.empty() && !write_all(fd, &out[0], out.size()))
+			break;
+	}
+
+	close(fd);
+	printf("client gone\n");
+	fflush(stdout);
+}
+
+void usage()
+{
+	printf("usage: tce [-r] [-p port]\n\n"
+		"  -r       RFC2217, answer telnet and COM port control\n"
+		"  -p port  port to listen on, default 7777\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	int port = 7777;
+	int opt, fd;
+	int on = 1;
+
+	while ((opt = getopt(argc, argv, "rp:h")) != -1) {
+		switch (opt) {
+		case 'r':
+			rfc2217 = true;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket failed");
+		exit(-1);
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    listen(fd, 4) == -1) {
+		perror("can't listen");
+		exit(-1);
+	}
+
+	printf("echoing on port %d%s\n", port, rfc2217 ? ", RFC2217" : "");
+	fflush(stdout);
+
+	for (;;) {
+		int client = accept(fd, 0, 0);
+
+		if (client == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("accept failed");
+			exit(-1);
+		}
+
+		printf("client connected\n");
+		fflush(stdout);
+		thread(serve, client).detach();
+	}
+
+	return 0;
+}
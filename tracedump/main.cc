@@ -0,0 +1,172 @@
+/*
+ * trd - flight recorder trace decoder
+ *
+ * Prints the records of a trace file written by the tools through
+ * util::trace_ring, by default the last ones before the ring has been
+ * frozen (the first error), with times relative to the freeze point.
+ *
+ * Nomovok (C) 2015 A. Dureghello
+ *
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <unistd.h>
+
+#include "trace.hh"
+
+using namespace nomovok;
+using namespace std;
+
+static const char *dir_name(uint8_t dir)
+{
+	switch (dir) {
+	case util::TRACE_TX: return "tx";
+	case util::TRACE_RX: return "rx";
+	}
+	return "--";
+}
+
+static const char *counter_name(uint32_t id)
+{
+	switch (id) {
+	case util::TRACE_CNT_RX: return "rx";
+	case util::TRACE_CNT_TX: return "tx";
+	case util::TRACE_CNT_FRAME: return "frame";
+	case util::TRACE_CNT_OVERRUN: return "overrun";
+	case util::TRACE_CNT_PARITY: return "parity";
+	case util::TRACE_CNT_BRK: return "brk";
+	case util::TRACE_CNT_BUF_OVERRUN: return "buf_overrun";
+	}
+	return "?";
+}
+
+static void print_record(uint64_t index, const util::trace_record &r,
+			 int64_t ref_ns, int64_t prev_ns)
+{
+	printf("%10" PRIu64 " %+14.3f %+10.3f %s ", index,
+		(int64_t)(r.ts_ns - ref_ns) / 1000.0,
+		prev_ns ? (int64_t)(r.ts_ns - prev_ns) / 1000.0 : 0.0,
+		dir_name(r.dir));
+
+	switch (r.event) {
+	case util::TRACE_BYTE:
+		printf("byte    %3u [%02x]", r.value & 0xff, r.value & 0xff);
+		if (r.dir == util::TRACE_RX)
+			printf(" exp %3u", r.aux & 0xff);
+		break;
+	case util::TRACE_BLOCK:
+		printf("block   %5u bytes [%08x]", r.len, r.value);
+		break;
+	case util::TRACE_ERROR:
+		printf("ERROR   exp %3u [%02x] got %3u [%02x]",
+			r.aux & 0xff, r.aux & 0xff,
+			r.value & 0xff, r.value & 0xff);
+		break;
+	case util::TRACE_RESET:
+		printf("reset");
+		break;
+	case util::TRACE_COUNTER:
+		printf("counter %s = %u", counter_name(r.value), r.aux);
+		break;
+	case util::TRACE_FREEZE:
+		printf("freeze  reason %u", r.value);
+		break;
+	case util::TRACE_MARK:
+		printf("mark    %u %u", r.value, r.aux);
+		break;
+	default:
+		printf("event %u value %u aux %u", r.event, r.value, r.aux);
+	}
+	printf("\n");
+}
+
+void usage()
+{
+	printf("usage: trd [-a] [-n records] tracefile\n\n"
+		"  -a          dump the whole ring\n"
+		"  -n records  records to show before the freeze point,"
+		" default 256\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t count = 256;
+	bool all = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "an:h")) != -1) {
+		switch (opt) {
+		case 'a':
+			all = true;
+			break;
+		case 'n':
+			count = strtoull(optarg, 0, 0);
+			break;
+		default:
+			usage();
+			exit(0);
+		}
+	}
+
+	if (optind >= argc) {
+		usage();
+		exit(0);
+	}
+
+	util::trace_ring ring;
+
+	if (!ring.attach(argv[optind]))
+		exit(-1);
+
+	const util::trace_header *h = ring.header();
+	uint64_t head = h->head.load();
+	uint32_t frozen = h->frozen.load();
+	uint64_t end = frozen ? h->freeze_head : head;
+	uint64_t begin = end > h->capacity ? end - h->capacity : 0;
+
+	if (!all && end - begin > count)
+		begin = end - count;
+
+	printf("trace %s: %" PRIu64 " records of %" PRIu64 ", %s\n",
+		argv[optind], head < h->capacity ? head : h->capacity,
+		h->capacity, frozen ? "frozen" : "not frozen (still running "
+		"or crashed before any error)");
+
+	/* time reference is the freeze point, or the last record */
+	int64_t ref_ns = frozen ? h->freeze_ns : 0;
+	uint64_t skipped = 0;
+
+	if (!ref_ns) {
+		for (uint64_t i = end; i > begin; --i) {
+			if (ring.valid(i - 1)) {
+				ref_ns = ring.at(i - 1).ts_ns;
+				break;
+			}
+		}
+	}
+
+	printf("%10s %14s %10s %s %s\n", "index", "t [us]", "dt [us]",
+		"dir", "event");
+
+	int64_t prev_ns = 0;
+
+	for (uint64_t i = begin; i < end; ++i) {
+		if (!ring.valid(i)) {
+			/* overwritten meanwhile or torn by a crash */
+			skipped++;
+			continue;
+		}
+		const util::trace_record &r = ring.at(i);
+		print_record(i, r, ref_ns, prev_ns);
+		prev_ns = r.ts_ns;
+	}
+
+	if (skipped)
+		printf("%" PRIu64 " incomplete records skipped\n", skipped);
+
+	return 0;
+}